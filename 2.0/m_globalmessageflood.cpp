@@ -28,42 +28,766 @@
 /* $ModDesc: Provides channel mode +x (oper only top-level channel flood protection with SNOMASK +F) */
 /* $ModDepends: core 2.0 */
 
-typedef std::map<User*, unsigned int> counter_t;
+/** What a message says, reduced to two hashes that the same or nearly the same text shares.
+ *
+ * The text is read once, ignoring case, formatting codes, spaces and punctuation. exact is an
+ * FNV-1a hash of what is left, and simhash is a SimHash of its three character shingles: each
+ * shingle votes on every bit, so texts that share most of their shingles end up with hashes
+ * that differ in only a few bits.
+ */
+struct messagefingerprint
+{
+	/* Messages shorter than this once reduced are too likely to be repeated innocently */
+	static const unsigned int MIN_LENGTH = 8;
+	/* Most bits two near duplicates' simhashes may differ in */
+	static const unsigned int MAX_DISTANCE = 10;
 
-/** Holds flood settings and state for mode +x
+	uint64_t exact;
+	uint64_t simhash;
+
+	/** Returns false if the text is too short to compare */
+	bool compute(const std::string &text)
+	{
+		int votes[64] = { 0 };
+		uint32_t shingle = 0;
+		unsigned int length = 0;
+		/* Digits left in a colour code, and whether a background colour may follow */
+		unsigned int colour = 0;
+		bool background = false;
+
+		exact = 14695981039346656037ULL;
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			unsigned char c = *i;
+			if (colour)
+			{
+				if (c >= '0' && c <= '9')
+				{
+					colour--;
+					continue;
+				}
+				colour = 0;
+				if (c == ',' && background)
+				{
+					background = false;
+					colour = 2;
+					continue;
+				}
+			}
+			if (c == '\x03')
+			{
+				colour = 2;
+				background = true;
+				continue;
+			}
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			else if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80))
+				continue;
+
+			exact = (exact ^ c) * 1099511628211ULL;
+			shingle = ((shingle << 8) | c) & 0xFFFFFF;
+			if (++length < 3)
+				continue;
+
+			// Spread the shingle over all 64 bits (the splitmix64 finaliser)
+			uint64_t h = shingle + 0x9E3779B97F4A7C15ULL;
+			h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+			h ^= h >> 31;
+			for (unsigned int bit = 0; bit < 64; ++bit)
+				votes[bit] += ((h >> bit) & 1) ? 1 : -1;
+		}
+
+		simhash = 0;
+		for (unsigned int bit = 0; bit < 64; ++bit)
+			if (votes[bit] > 0)
+				simhash |= 1ULL << bit;
+		return (length >= MIN_LENGTH);
+	}
+
+	bool matches(uint64_t otherexact, uint64_t othersimhash) const
+	{
+		if (exact == otherexact)
+			return true;
+
+		uint64_t diff = simhash ^ othersimhash;
+		diff = diff - ((diff >> 1) & 0x5555555555555555ULL);
+		diff = (diff & 0x3333333333333333ULL) + ((diff >> 2) & 0x3333333333333333ULL);
+		diff = (diff + (diff >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+		return ((diff * 0x0101010101010101ULL) >> 56 <= MAX_DISTANCE);
+	}
+};
+
+/** Recent messages in a channel and the distinct users who sent each of them
+ *
+ * Holds a fixed number of fingerprints, replacing the one seen longest ago when a new message
+ * matches none of them, so a busy channel can't make it grow. Empty unless the +x parameter
+ * asks for duplicate detection.
  */
-class globalfloodsettings
+class duplicatewindow
 {
  public:
-	bool ban;
+	static const unsigned int ENTRIES = 64;
+	/* Most distinct users a fingerprint keeps track of, and so the highest threshold */
+	static const unsigned int MAX_USERS = 16;
+
+	struct entry
+	{
+		uint64_t exact;
+		uint64_t simhash;
+		/* When a message last matched, in milliseconds */
+		unsigned long long last;
+		unsigned int count;
+		/* Hashes of the UUIDs of the users who sent it */
+		uint32_t senders[MAX_USERS];
+		/* Whether opers have been told about it */
+		bool noticed;
+	};
+
+	/* Distinct users that make a message a flood, or 0 if duplicates aren't looked for */
+	const unsigned int users;
+
+ private:
+	std::vector<entry> entries;
+
+ public:
+	duplicatewindow(unsigned int Users) : users(Users)
+	{
+		if (users)
+			entries.resize(ENTRIES, entry());
+	}
+
+	/** Counts a message, returning its entry if enough distinct users have now sent it within
+	 * span milliseconds of each other, or NULL otherwise.
+	 */
+	entry* add(User* who, const messagefingerprint &fp, unsigned long long now, unsigned long long span)
+	{
+		entry* match = NULL;
+		entry* oldest = &entries[0];
+		for (std::vector<entry>::iterator i = entries.begin(); i != entries.end(); ++i)
+		{
+			if (i->count && now - i->last <= span && fp.matches(i->exact, i->simhash))
+			{
+				match = &*i;
+				break;
+			}
+			if (i->last < oldest->last)
+				oldest = &*i;
+		}
+
+		if (!match)
+		{
+			match = oldest;
+			match->exact = fp.exact;
+			match->simhash = fp.simhash;
+			match->count = 0;
+			match->noticed = false;
+		}
+		match->last = now;
+
+		uint32_t sender = 2166136261U;
+		for (std::string::const_iterator i = who->uuid.begin(); i != who->uuid.end(); ++i)
+			sender = (sender ^ static_cast<unsigned char>(*i)) * 16777619U;
+		bool seen = false;
+		for (unsigned int i = 0; i < match->count && !seen; ++i)
+			seen = (match->senders[i] == sender);
+		if (!seen && match->count < MAX_USERS)
+			match->senders[match->count++] = sender;
+
+		return (match->count >= users) ? match : NULL;
+	}
+};
+
+/* BEGIN shared/usertable.h: edit that file and run ./sync-shared */
+/** An open-addressing hash table from local users to a small value, keyed by UUID.
+ *
+ * Entries live in a single array and are found by linear probing, so a lookup touches a cache
+ * line or two instead of walking a tree of heap nodes. Keys are UUIDs rather than User pointers,
+ * which a new user may get after the old one quits. The table never holds more than MAX_ENTRIES;
+ * once full, adding a user evicts another one, so memory stays bounded during join floods.
+ */
+template<typename Value>
+class UserTable
+{
+ public:
+	static const unsigned int MAX_ENTRIES = 4096;
+
+ private:
+	struct Slot
+	{
+		uint32_t hash;
+		/* Empty if the first character is 0 */
+		char uuid[UUID_LENGTH];
+		Value value;
+	};
+
+	std::vector<Slot> slots;
+	unsigned int count;
+	/* Where to look for an entry to evict when the table is full */
+	unsigned int victim;
+
+	static uint32_t hashOf(const std::string &uuid)
+	{
+		uint32_t h = 2166136261U;
+		for (std::string::const_iterator i = uuid.begin(); i != uuid.end(); ++i)
+			h = (h ^ static_cast<unsigned char>(*i)) * 16777619U;
+		return h;
+	}
+
+	unsigned int mask() const
+	{
+		return slots.size() - 1;
+	}
+
+	/** Returns the slot holding the user, or the empty slot where they would go */
+	unsigned int probe(const std::string &uuid, uint32_t h) const
+	{
+		unsigned int i = h & mask();
+		while (slots[i].uuid[0] && (slots[i].hash != h || uuid.compare(slots[i].uuid)))
+			i = (i + 1) & mask();
+		return i;
+	}
+
+	void resize(unsigned int size)
+	{
+		std::vector<Slot> old(size);
+		old.swap(slots);
+		for (unsigned int i = 0; i < slots.size(); ++i)
+			slots[i].uuid[0] = 0;
+		for (typename std::vector<Slot>::const_iterator i = old.begin(); i != old.end(); ++i)
+		{
+			if (!i->uuid[0])
+				continue;
+			unsigned int j = i->hash & mask();
+			while (slots[j].uuid[0])
+				j = (j + 1) & mask();
+			slots[j] = *i;
+		}
+		victim = 0;
+	}
+
+ public:
+	UserTable() : count(0), victim(0)
+	{
+	}
+
+	Value *find(User *user)
+	{
+		if (!count)
+			return NULL;
+		unsigned int i = probe(user->uuid, hashOf(user->uuid));
+		return slots[i].uuid[0] ? &slots[i].value : NULL;
+	}
+
+	/** Returns the user's entry, adding a default-constructed one if there is none.
+	 * The reference is only good until the table is next changed.
+	 */
+	Value &get(User *user)
+	{
+		uint32_t h = hashOf(user->uuid);
+		if (count)
+		{
+			unsigned int i = probe(user->uuid, h);
+			if (slots[i].uuid[0])
+				return slots[i].value;
+		}
+
+		// Keep the table at most half full
+		if (count >= MAX_ENTRIES)
+		{
+			while (!slots[victim & mask()].uuid[0])
+				victim++;
+			eraseAt(victim++ & mask());
+		}
+		else if ((count + 1) * 2 > slots.size())
+		{
+			resize(std::max<unsigned int>(slots.size() * 2, 16));
+		}
+
+		unsigned int i = probe(user->uuid, h);
+		slots[i].hash = h;
+		user->uuid.copy(slots[i].uuid, UUID_LENGTH - 1);
+		slots[i].uuid[std::min<size_t>(user->uuid.size(), UUID_LENGTH - 1)] = 0;
+		slots[i].value = Value();
+		count++;
+		return slots[i].value;
+	}
+
+	void erase(User *user)
+	{
+		if (!count)
+			return;
+		unsigned int i = probe(user->uuid, hashOf(user->uuid));
+		if (slots[i].uuid[0])
+			eraseAt(i);
+	}
+
+	/** Empties a slot, moving later entries of the same probe run back so lookups need no tombstones */
+	void eraseAt(unsigned int slot)
+	{
+		unsigned int hole = slot;
+		for (unsigned int i = (slot + 1) & mask(); slots[i].uuid[0]; i = (i + 1) & mask())
+		{
+			// An entry can only move back if its home slot isn't between the hole and where it is now
+			unsigned int home = slots[i].hash & mask();
+			if (((i - home) & mask()) >= ((i - hole) & mask()))
+			{
+				slots[hole] = slots[i];
+				hole = i;
+			}
+		}
+		slots[hole].uuid[0] = 0;
+		count--;
+	}
+
+	void clear()
+	{
+		slots.clear();
+		count = 0;
+		victim = 0;
+	}
+
+	unsigned int size() const
+	{
+		return count;
+	}
+
+	/** Number of slots, for walking the table with at() */
+	unsigned int capacity() const
+	{
+		return slots.size();
+	}
+
+	/** Returns the entry in a slot, or NULL if the slot is empty */
+	Value *at(unsigned int slot)
+	{
+		return slots[slot].uuid[0] ? &slots[slot].value : NULL;
+	}
+};
+/* END shared/usertable.h */
+
+/* BEGIN shared/ratelimit.h: edit that file and run ./sync-shared */
+/** A limit of some number of lines or bytes every secs seconds, as set by a channel mode */
+class ratelimit
+{
+ public:
+	unsigned int limit;
 	unsigned int secs;
-	unsigned int lines;
-	time_t reset;
-	counter_t counters;
 
-	globalfloodsettings(bool a, int b, int c) : ban(a), secs(b), lines(c)
+	ratelimit(unsigned int Limit, unsigned int Secs) : limit(Limit), secs(Secs)
+	{
+	}
+
+	/** The window things are counted over, in milliseconds */
+	unsigned long long span() const
+	{
+		return secs * 1000ULL;
+	}
+
+	/** Reads a mode parameter of the form <limit>:<secs>, returning false if it isn't valid */
+	bool parse(const std::string &str)
+	{
+		std::string::size_type colon = str.find(':');
+		if ((colon == std::string::npos) || (str.find('-') != std::string::npos))
+			return false;
+
+		limit = ConvToInt(str.substr(0, colon));
+		secs = ConvToInt(str.substr(colon + 1));
+		return ((limit >= 2) && (secs >= 1));
+	}
+
+	std::string str() const
+	{
+		return ConvToStr(limit) + ":" + ConvToStr(secs);
+	}
+
+	/** The current time in milliseconds */
+	static unsigned long long now()
+	{
+		return ServerInstance->Time() * 1000ULL + ServerInstance->Time_ns() / 1000000;
+	}
+};
+
+/* Window policies for ratelimiter. Each keeps a state per key and a clock shared by every key of
+ * a limiter, and provides:
+ *	start(clock, now, rate)               once, when the limiter is made
+ *	advance(clock, now, rate)             before every count
+ *	add(state, clock, now, rate, amount)  counts amount, returns true if the key is now at the limit
+ *	idle(state, clock, now, rate)         whether the state no longer matters and can be forgotten
+ * A new state is default constructed. Times are in milliseconds, see ratelimit::now().
+ */
+
+/** Counts in windows of secs shared by every key, the first starting with the limiter.
+ *
+ * A window ends once the second it was due to end in is over. Counts from before the current
+ * window are left in place and read as zero, rather than clearing every count when it ends.
+ */
+struct fixedwindow
+{
+	struct clock
+	{
+		unsigned long epoch;
+		/* The second the current window ends with */
+		unsigned long long reset;
+	};
+
+	struct state
+	{
+		unsigned long epoch;
+		unsigned long long count;
+
+		state() : epoch(0), count(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		c.epoch = 0;
+		c.reset = now / 1000 + rate.secs;
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		if (now / 1000 > c.reset)
+		{
+			c.epoch++;
+			c.reset = now / 1000 + rate.secs;
+		}
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		if (s.epoch != c.epoch)
+		{
+			s.epoch = c.epoch;
+			s.count = 0;
+		}
+		s.count += amount;
+		return (s.count >= rate.limit);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		return (s.epoch != c.epoch);
+	}
+};
+
+/** Counts in windows of secs that start with the first count rather than on a shared boundary.
+ *
+ * The count for the last secs is estimated from the current window plus the part of the previous
+ * window that still overlaps it, so a burst across a window boundary still counts.
+ */
+struct slidingwindow
+{
+	struct clock
+	{
+	};
+
+	struct state
+	{
+		/* Start of the current window */
+		unsigned long long start;
+		unsigned long long current;
+		unsigned long long previous;
+
+		state() : start(0), current(0), previous(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		unsigned long long span = rate.span();
+		if (idle(s, c, now, rate))
+		{
+			s.start = now;
+			s.current = s.previous = 0;
+		}
+		else if (now - s.start >= span)
+		{
+			s.start += span;
+			s.previous = s.current;
+			s.current = 0;
+		}
+		s.current += amount;
+
+		/* The previous window's count is taken to be spread evenly over it. The overlap leaves
+		 * out its first millisecond, which is no longer in the last span, so users who speak on a
+		 * timer at just under the limit don't trip it at every window boundary. */
+		unsigned long long overlap = span - (now - s.start) - 1;
+		return (s.previous * overlap / span + s.current >= rate.limit);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		return (now - s.start >= 2 * rate.span());
+	}
+};
+
+/** Lets limit through at once, then limit more every secs as the bucket drains.
+ *
+ * Each line or byte adds span to the level, which drains by limit every millisecond, so the key
+ * is at the limit once the level reaches limit * span. What is counted beyond that is dropped
+ * rather than kept as debt, so a key that stops is let through again within secs.
+ */
+struct tokenbucket
+{
+	struct clock
+	{
+		/* limit * span, or as much as fits */
+		unsigned long long full;
+		/* Longest time that can be multiplied by limit without overflowing */
+		unsigned long long longest;
+	};
+
+	struct state
+	{
+		unsigned long long level;
+		unsigned long long last;
+
+		state() : level(0), last(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		unsigned long long most = ~0ULL;
+		unsigned long long span = rate.span();
+		c.full = (rate.limit && span > most / rate.limit) ? most : rate.limit * span;
+		c.longest = rate.limit ? most / rate.limit : most;
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
 	{
-		reset = ServerInstance->Time() + secs;
 	}
 
-	bool addmessage(User* who)
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
 	{
-		if (ServerInstance->Time() > reset)
+		unsigned long long elapsed = now - s.last;
+		if (s.level)
 		{
-			counters.clear();
-			reset = ServerInstance->Time() + secs;
+			if (elapsed > c.longest || elapsed * rate.limit >= s.level)
+				s.level = 0;
+			else
+				s.level -= elapsed * rate.limit;
 		}
+		s.last = now;
+
+		unsigned long long cost = amount * rate.span();
+		s.level = (cost >= c.full - s.level) ? c.full : s.level + cost;
+		return (s.level >= c.full);
+	}
 
-		return (++counters[who] >= this->lines);
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		unsigned long long elapsed = now - s.last;
+		return (elapsed > c.longest || elapsed * rate.limit >= s.level);
 	}
+};
+
+/* Scope policies for ratelimiter, which decide what a count belongs to */
+
+/** Counts each local user on their own, forgetting idle users a couple at a time as counts come in */
+struct peruser
+{
+	template<typename Window>
+	class keys
+	{
+		UserTable<typename Window::state> states;
+		/* Slot of states that idle users are checked for from */
+		unsigned int cursor;
+
+	 public:
+		keys() : cursor(0)
+		{
+		}
+
+		typename Window::state &get(User *who)
+		{
+			return states.get(who);
+		}
 
-	void clear(User* who)
+		void forget(User *who)
+		{
+			states.erase(who);
+		}
+
+		unsigned int size() const
+		{
+			return states.size();
+		}
+
+		void expire(const typename Window::clock &c, unsigned long long now, const ratelimit &rate)
+		{
+			for (unsigned int i = 0; i < 2 && states.size(); ++i)
+			{
+				if (cursor >= states.capacity())
+					cursor = 0;
+				typename Window::state *s = states.at(cursor);
+				// Erasing can move the next entry into this slot, so it is looked at again
+				if (s && Window::idle(*s, c, now, rate))
+					states.eraseAt(cursor);
+				else
+					++cursor;
+			}
+		}
+	};
+};
+
+/** Counts everything in the channel together */
+struct perchannel
+{
+	template<typename Window>
+	class keys
 	{
-		counter_t::iterator iter = counters.find(who);
-		if (iter != counters.end())
+		typename Window::state state;
+
+	 public:
+		typename Window::state &get(User *who)
+		{
+			return state;
+		}
+
+		void forget(User *who)
+		{
+		}
+
+		unsigned int size() const
+		{
+			return 1;
+		}
+
+		void expire(const typename Window::clock &c, unsigned long long now, const ratelimit &rate)
 		{
-			counters.erase(iter);
 		}
+	};
+};
+
+/* Measure policies for ratelimiter, which decide how much a message counts for */
+
+struct countlines
+{
+	static unsigned long long amount(const std::string &text)
+	{
+		return 1;
+	}
+};
+
+struct countbytes
+{
+	static unsigned long long amount(const std::string &text)
+	{
+		return text.length();
+	}
+};
+
+/** Limits what is said in a channel, with the policies picked at compile time so that each mode
+ * only pays for what it uses: fixedwindow, slidingwindow or tokenbucket; peruser or perchannel;
+ * countlines or countbytes.
+ */
+template<typename Window, typename Scope, typename Measure>
+class ratelimiter : public ratelimit
+{
+	typename Window::clock clock;
+	typename Scope::template keys<Window> keys;
+
+	bool count(User *who, unsigned long long amount)
+	{
+		unsigned long long t = now();
+		Window::advance(clock, t, *this);
+		keys.expire(clock, t, *this);
+		return Window::add(keys.get(who), clock, t, *this, amount);
+	}
+
+ public:
+	ratelimiter(const ratelimit &rate) : ratelimit(rate)
+	{
+		Window::start(clock, now(), *this);
+	}
+
+	/** Counts a message, returning true if that brings its sender, or the channel, to the limit */
+	bool add(User *who, const std::string &text)
+	{
+		return count(who, Measure::amount(text));
+	}
+
+	/** Counts lines or bytes sent somewhere else, e.g. on another server */
+	void addamount(User *who, unsigned long long amount)
+	{
+		count(who, amount);
+	}
+
+	/** Returns true if the sender, or the channel, is at the limit already */
+	bool full(User *who)
+	{
+		return count(who, 0);
+	}
+
+	void forget(User *who)
+	{
+		keys.forget(who);
+	}
+
+	/** Number of counts kept, for one channel */
+	unsigned int size() const
+	{
+		return keys.size();
+	}
+};
+/* END shared/ratelimit.h */
+
+/* Each local user's lines in a channel */
+typedef ratelimiter<slidingwindow, peruser, countlines> userfloodlimit;
+/* Lines the whole channel sends across the network, a limit of 0 meaning there is none */
+typedef ratelimiter<slidingwindow, perchannel, countlines> networkfloodlimit;
+
+/** Holds flood settings and state for mode +x
+ *
+ * Each user's lines are counted in a sliding window, see slidingwindow. Users whose windows have
+ * run out are forgotten a couple at a time as messages come in, and users who leave are
+ * forgotten at once.
+ *
+ * Each user is only counted by their own server, which is enough to limit any one user. If the
+ * network limit is set, the whole channel is also limited to that many lines in secs across the
+ * network: servers add up their local messages per channel and report them to each other once
+ * a second, so a flood spread over many users on many servers is caught too.
+ *
+ * If duplicates.users is set, the channel also looks for the same or nearly the same text sent
+ * by that many different local users within secs of each other, which is how botnets usually
+ * flood while keeping every single user under the limit.
+ */
+class globalfloodsettings
+{
+ public:
+	bool ban;
+	userfloodlimit users;
+	/* Lines the whole channel may send across the network */
+	networkfloodlimit network;
+
+	/* Local messages not yet reported to other servers */
+	unsigned int unsent;
+	/* Whether the channel is waiting for the next report */
+	bool queued;
+	/* When the network limit was last announced as reached */
+	time_t noticed;
+
+	duplicatewindow duplicates;
+
+	globalfloodsettings(bool a, const ratelimit &rate, unsigned int chanlines, unsigned int dupusers)
+		: ban(a), users(rate), network(ratelimit(chanlines, rate.secs)), unsent(0), queued(false), noticed(0),
+		  duplicates(dupusers)
+	{
 	}
 };
 
@@ -84,31 +808,36 @@ class GlobalMsgFlood : public ModeHandler
 	{
 		if (adding)
 		{
-			std::string::size_type colon = parameter.find(':');
-			if ((colon == std::string::npos) || (parameter.find('-') != std::string::npos))
-			{
-				source->WriteNumeric(608, "%s %s :Invalid flood parameter",source->nick.c_str(),channel->name.c_str());
-				return MODEACTION_DENY;
-			}
-
-			/* Set up the flood parameters for this channel */
+			/* Set up the flood parameters for this channel, [*]lines:secs[:chanlines[:dupusers]].
+			 * chanlines limits the whole channel across the network and dupusers is how many users
+			 * may send the same text; either is off if 0 or left out. */
 			bool ban = (parameter[0] == '*');
-			unsigned int nlines = ConvToInt(parameter.substr(ban ? 1 : 0, ban ? colon-1 : colon));
-			unsigned int nsecs = ConvToInt(parameter.substr(colon+1));
+			std::string::size_type chancolon = parameter.find(':', parameter.find(':') + 1);
+			std::string::size_type dupcolon = (chancolon == std::string::npos) ? chancolon : parameter.find(':', chancolon+1);
+			ratelimit rate(0, 0);
+			unsigned int nchanlines = (chancolon == std::string::npos) ? 0 : ConvToInt(parameter.substr(chancolon+1));
+			unsigned int ndupusers = (dupcolon == std::string::npos) ? 0 : ConvToInt(parameter.substr(dupcolon+1));
 
-			if ((nlines<2) || (nsecs<1))
+			if (!rate.parse(parameter.substr(ban ? 1 : 0, chancolon == std::string::npos ? std::string::npos : chancolon - (ban ? 1 : 0)))
+				|| (parameter.find('-') != std::string::npos) || (nchanlines == 1) || (ndupusers == 1)
+				|| (ndupusers > duplicatewindow::MAX_USERS))
 			{
 				source->WriteNumeric(608, "%s %s :Invalid flood parameter",source->nick.c_str(),channel->name.c_str());
 				return MODEACTION_DENY;
 			}
 
 			globalfloodsettings* f = ext.get(channel);
-			if ((f) && (nlines == f->lines) && (nsecs == f->secs) && (ban == f->ban))
+			if ((f) && (rate.limit == f->users.limit) && (rate.secs == f->users.secs) && (ban == f->ban) && (nchanlines == f->network.limit)
+				&& (ndupusers == f->duplicates.users))
 				// mode params match
 				return MODEACTION_DENY;
 
-			ext.set(channel, new globalfloodsettings(ban, nsecs, nlines));
-			parameter = std::string(ban ? "*" : "") + ConvToStr(nlines) + ":" + ConvToStr(nsecs);
+			ext.set(channel, new globalfloodsettings(ban, rate, nchanlines, ndupusers));
+			parameter = std::string(ban ? "*" : "") + rate.str();
+			if (nchanlines || ndupusers)
+				parameter += ":" + ConvToStr(nchanlines);
+			if (ndupusers)
+				parameter += ":" + ConvToStr(ndupusers);
 			channel->SetModeParam('x', parameter);
 			return MODEACTION_ALLOW;
 		}
@@ -130,26 +859,147 @@ class GlobalMsgFlood : public ModeHandler
 	}
 };
 
+/** Receives the messages other servers counted in +x channels with a network-wide limit
+ *
+ * Sent over ENCAP as GLOBALFLOOD :<channel> <count> [<channel> <count> ...]
+ */
+class CommandGlobalFlood : public Command
+{
+	GlobalMsgFlood& mf;
+
+ public:
+	CommandGlobalFlood(Module* Creator, GlobalMsgFlood& mode) : Command(Creator, "GLOBALFLOOD", 1, 1), mf(mode)
+	{
+		syntax = "<channel> <count> [<channel> <count> ...]";
+	}
+
+	CmdResult Handle(const std::vector<std::string> &parameters, User *user)
+	{
+		// Only ever sent by servers over ENCAP
+		if (IS_LOCAL(user) || !IS_SERVER(user))
+			return CMD_FAILURE;
+
+		irc::spacesepstream sep(parameters[0]);
+		std::string name, count;
+		while (sep.GetToken(name) && sep.GetToken(count))
+		{
+			Channel* chan = ServerInstance->FindChan(name);
+			globalfloodsettings* f = chan ? mf.ext.get(chan) : NULL;
+			if (f && f->network.limit)
+				f->network.addamount(NULL, ConvToInt(count));
+		}
+		return CMD_SUCCESS;
+	}
+};
+
+class ModuleGlobalMsgFlood;
+
+/** Reports local messages in channels with a network-wide limit once a second */
+class GlobalFloodTimer : public Timer
+{
+	ModuleGlobalMsgFlood* creator;
+
+ public:
+	GlobalFloodTimer(ModuleGlobalMsgFlood* m) : Timer(1, ServerInstance->Time(), true), creator(m)
+	{
+	}
+
+	void Tick(time_t);
+};
+
+/* Reported as ircd_globalmessageflood, see the top of m_telegraf.cpp */
+struct TelegrafMetric
+{
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+	const char *name;
+	int type;
+	long long value;
+	unsigned long long *buckets;
+};
+
+struct TelegrafMetrics
+{
+	enum { MAGIC = 0x54474d53, VERSION = 1, BUCKETS = 64 };
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	TelegrafMetric *metrics;
+};
+
+class GlobalFloodMetrics : public DataProvider
+{
+ public:
+	enum Field
+	{
+		TRIGGERED,
+		NETWORK_DENIED,
+		REPORTED,
+		DUPLICATES,
+		FIELDS
+	};
+
+	TelegrafMetrics telegraf;
+	TelegrafMetric fields[FIELDS];
+
+	GlobalFloodMetrics(Module* Creator) : DataProvider(Creator, "telegraf/globalmessageflood")
+	{
+		static const char *const names[FIELDS] = { "triggered", "network_denied", "reported", "duplicates" };
+		for (unsigned int i = 0; i < FIELDS; ++i)
+		{
+			fields[i].name = names[i];
+			fields[i].type = TelegrafMetric::COUNTER;
+			fields[i].value = 0;
+			fields[i].buckets = NULL;
+		}
+		telegraf.magic = TelegrafMetrics::MAGIC;
+		telegraf.version = TelegrafMetrics::VERSION;
+		telegraf.count = FIELDS;
+		telegraf.metrics = fields;
+	}
+
+	void inc(Field field)
+	{
+		fields[field].value++;
+	}
+};
+
 class ModuleGlobalMsgFlood : public Module
 {
 	GlobalMsgFlood mf;
+	CommandGlobalFlood cmd;
+	GlobalFloodMetrics metrics;
+	GlobalFloodTimer* timer;
+	/* Channels with local messages to report, see globalfloodsettings::queued */
+	std::vector<std::string> pending;
 
  public:
 
 	ModuleGlobalMsgFlood()
-		: mf(this)
+		: mf(this), cmd(this, mf), metrics(this), timer(NULL)
+	{
+	}
+
+	~ModuleGlobalMsgFlood()
 	{
+		if (timer)
+			ServerInstance->Timers->DelTimer(timer);
 	}
 
 	void init()
 	{
 		ServerInstance->Modules->AddService(mf);
 		ServerInstance->Modules->AddService(mf.ext);
+		ServerInstance->Modules->AddService(cmd);
+		ServerInstance->Modules->AddService(metrics);
+		timer = new GlobalFloodTimer(this);
+		ServerInstance->Timers->AddTimer(timer);
 
 		/* Enables Flood announcements for everyone with +s +f */
 		ServerInstance->SNO->EnableSnomask('f', "FLOOD");
 
-		Implementation eventlist[] = { I_OnUserPreNotice, I_OnUserPreMessage };
+		Implementation eventlist[] = { I_OnUserPreNotice, I_OnUserPreMessage, I_OnUserQuit, I_OnUserPart, I_OnUserKick };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
@@ -164,21 +1014,109 @@ class ModuleGlobalMsgFlood : public Module
 		globalfloodsettings *f = mf.ext.get(dest);
 		if (f)
 		{
-			if (f->addmessage(user))
+			if (f->users.add(user, text))
 			{
-				f->clear(user);
+				f->users.forget(user);
+				metrics.inc(GlobalFloodMetrics::TRIGGERED);
 				/* Generate the SNOTICE when someone triggers the flood limit */
 
 				ServerInstance->SNO->WriteGlobalSno('f', "Global channel flood triggered by %s (%s) in %s (limit was %u lines in %u secs)",
-													user->GetFullRealHost().c_str(), user->GetFullHost().c_str(), dest->name.c_str(), f->lines, f->secs);
+													user->GetFullRealHost().c_str(), user->GetFullHost().c_str(), dest->name.c_str(), f->users.limit, f->users.secs);
 
 				return MOD_RES_DENY;
 			}
+
+			messagefingerprint fp;
+			if (f->duplicates.users && fp.compute(text))
+			{
+				duplicatewindow::entry* flood = f->duplicates.add(user, fp, ratelimit::now(), f->users.span());
+				if (flood)
+				{
+					metrics.inc(GlobalFloodMetrics::DUPLICATES);
+					if (!flood->noticed)
+					{
+						flood->noticed = true;
+						ServerInstance->SNO->WriteGlobalSno('f', "Duplicate message flood in %s, last sent by %s (%s) (limit was %u users in %u secs)",
+															dest->name.c_str(), user->GetFullRealHost().c_str(), user->GetFullHost().c_str(), f->duplicates.users, f->users.secs);
+					}
+					return MOD_RES_DENY;
+				}
+			}
+
+			if (f->network.limit)
+			{
+				if (f->network.full(NULL))
+				{
+					metrics.inc(GlobalFloodMetrics::NETWORK_DENIED);
+					// Every server sees the limit being reached, so each only tells its own opers
+					if (ServerInstance->Time() >= f->noticed + f->network.secs)
+					{
+						f->noticed = ServerInstance->Time();
+						ServerInstance->SNO->WriteToSnoMask('f', "Network-wide channel flood limit reached in %s (limit was %u lines in %u secs)",
+															dest->name.c_str(), f->network.limit, f->network.secs);
+					}
+					return MOD_RES_DENY;
+				}
+
+				f->network.addamount(NULL, 1);
+				f->unsent++;
+				if (!f->queued)
+				{
+					f->queued = true;
+					pending.push_back(dest->name);
+				}
+			}
 		}
 
 		return MOD_RES_PASSTHRU;
 	}
 
+	/** Sends other servers the local message counts of every channel that had any since the last
+	 * report, packing as many channels into each ENCAP as fit, so the traffic depends on how many
+	 * channels are busy rather than on how much is said in them.
+	 */
+	void SendCounts()
+	{
+		std::string line;
+		for (std::vector<std::string>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+		{
+			Channel* chan = ServerInstance->FindChan(*i);
+			globalfloodsettings* f = chan ? mf.ext.get(chan) : NULL;
+			if (!f || !f->queued)
+				continue;
+
+			f->queued = false;
+			if (!f->unsent)
+				continue;
+
+			std::string entry = chan->name + " " + ConvToStr(f->unsent);
+			f->unsent = 0;
+			// Leave room for the prefix, ENCAP, the target and the command name
+			if (!line.empty() && line.length() + entry.length() >= 400)
+			{
+				SendLine(line);
+				line.clear();
+			}
+			if (!line.empty())
+				line.push_back(' ');
+			line.append(entry);
+		}
+		pending.clear();
+
+		if (!line.empty())
+			SendLine(line);
+	}
+
+	void SendLine(const std::string& line)
+	{
+		parameterlist params;
+		params.push_back("*");
+		params.push_back("GLOBALFLOOD");
+		params.push_back(":" + line);
+		ServerInstance->PI->SendEncapsulatedData(params);
+		metrics.inc(GlobalFloodMetrics::REPORTED);
+	}
+
 	ModResult OnUserPreMessage(User *user, void *dest, int target_type, std::string &text, char status, CUList &exempt_list)
 	{
 		if (target_type == TYPE_CHANNEL)
@@ -195,6 +1133,34 @@ class ModuleGlobalMsgFlood : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	void Forget(User* user, Channel* chan)
+	{
+		globalfloodsettings *f = mf.ext.get(chan);
+		if (f)
+			f->users.forget(user);
+	}
+
+	void OnUserQuit(User* user, const std::string &message, const std::string &oper_message)
+	{
+		if (!IS_LOCAL(user))
+			return;
+
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+			Forget(user, *i);
+	}
+
+	void OnUserPart(Membership* memb, std::string &partmessage, CUList &except_list)
+	{
+		if (IS_LOCAL(memb->user))
+			Forget(memb->user, memb->chan);
+	}
+
+	void OnUserKick(User* source, Membership* memb, const std::string &reason, CUList &except_list)
+	{
+		if (IS_LOCAL(memb->user))
+			Forget(memb->user, memb->chan);
+	}
+
 	void Prioritize()
 	{
 		// we want to be after all modules that might deny the message (e.g. m_muteban, m_noctcp, m_blockcolor, etc.)
@@ -208,4 +1174,9 @@ class ModuleGlobalMsgFlood : public Module
 	}
 };
 
+void GlobalFloodTimer::Tick(time_t)
+{
+	creator->SendCounts();
+}
+
 MODULE_INIT(ModuleGlobalMsgFlood)
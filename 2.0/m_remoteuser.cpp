@@ -74,14 +74,56 @@ static void send_message(Channel *c, const std::string &source, std::string text
  * be pretty bad to broadcast infinitely.
  */
 
+/* Reported as ircd_remoteuser, see the top of m_telegraf.cpp */
+struct TelegrafMetric
+{
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+	const char *name;
+	int type;
+	long long value;
+	unsigned long long *buckets;
+};
+
+struct TelegrafMetrics
+{
+	enum { MAGIC = 0x54474d53, VERSION = 1, BUCKETS = 64 };
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	TelegrafMetric *metrics;
+};
+
+class RemoteUserMetrics : public DataProvider
+{
+public:
+	TelegrafMetrics telegraf;
+	/* Messages sent to local channel members on behalf of another server */
+	TelegrafMetric relayed;
+
+	RemoteUserMetrics(Module *Creator) : DataProvider(Creator, "telegraf/remoteuser")
+	{
+		relayed.name = "relayed";
+		relayed.type = TelegrafMetric::COUNTER;
+		relayed.value = 0;
+		relayed.buckets = NULL;
+		telegraf.magic = TelegrafMetrics::MAGIC;
+		telegraf.version = TelegrafMetrics::VERSION;
+		telegraf.count = 1;
+		telegraf.metrics = &relayed;
+	}
+};
+
 /** Base class for /NPC and /NPCA
  */
 class NPCx
 {
 	std::string cmdName, text;
+	RemoteUserMetrics &metrics;
 
 public:
-	NPCx(const std::string &cmd) : cmdName(cmd)
+	NPCx(const std::string &cmd, RemoteUserMetrics &Metrics) : cmdName(cmd), metrics(Metrics)
 	{
 	}
 
@@ -120,6 +162,7 @@ public:
 		std::string npc_source = npc_nick + "!npc@" + ServerInstance->Config->ServerName;
 
 			send_message(c, npc_source, this->text, action);
+			metrics.relayed.value++;
 #ifdef DEBUG_REMOTEUSER
 			if (localUser)
 			{
@@ -147,7 +190,8 @@ public:
 class CommandRemoteUser : public Command, public NPCx
 {
 public:
-	CommandRemoteUser(Module *parent) : Command(parent, "REMOTEUSER", 3, 3), NPCx("REMOTEUSER")
+	CommandRemoteUser(Module *parent, RemoteUserMetrics &metrics)
+		: Command(parent, "REMOTEUSER", 3, 3), NPCx("REMOTEUSER", metrics)
 	{
 		this->syntax = "<channel> <name> <text>";
 	}
@@ -163,10 +207,11 @@ public:
 
 class ModuleRemoteUserCommand : public Module
 {
+	RemoteUserMetrics metrics;
 	CommandRemoteUser remote_user;
 
 public:
-	ModuleRemoteUserCommand() : remote_user(this)
+	ModuleRemoteUserCommand() : metrics(this), remote_user(this, metrics)
 	{
     }
 
@@ -177,7 +222,7 @@ public:
 
 	void init()
 	{
-		ServiceProvider *services[] = { &this->remote_user, };
+		ServiceProvider *services[] = { &this->remote_user, &this->metrics, };
 		ServerInstance->Modules->AddServices(services, sizeof(services) / sizeof(services[0]));
 
 		ServerInstance->Modules->Attach(I_OnPreCommand, this);
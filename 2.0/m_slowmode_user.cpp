@@ -33,41 +33,557 @@
 /* $ModDesc: Provides channel mode +U (enables snoonet slowmode) */
 /* $ModDepends: core 2.0 */
 
-/** Holds flag settings and state for mode +U
+/* BEGIN shared/usertable.h: edit that file and run ./sync-shared */
+/** An open-addressing hash table from local users to a small value, keyed by UUID.
+ *
+ * Entries live in a single array and are found by linear probing, so a lookup touches a cache
+ * line or two instead of walking a tree of heap nodes. Keys are UUIDs rather than User pointers,
+ * which a new user may get after the old one quits. The table never holds more than MAX_ENTRIES;
+ * once full, adding a user evicts another one, so memory stays bounded during join floods.
  */
-class slmodsettings
+template<typename Value>
+class UserTable
 {
-public:
-    unsigned int secs;
-    unsigned int lines;
-    time_t reset;
-    std::map<User*, unsigned int> counters;
+ public:
+	static const unsigned int MAX_ENTRIES = 4096;
+
+ private:
+	struct Slot
+	{
+		uint32_t hash;
+		/* Empty if the first character is 0 */
+		char uuid[UUID_LENGTH];
+		Value value;
+	};
+
+	std::vector<Slot> slots;
+	unsigned int count;
+	/* Where to look for an entry to evict when the table is full */
+	unsigned int victim;
+
+	static uint32_t hashOf(const std::string &uuid)
+	{
+		uint32_t h = 2166136261U;
+		for (std::string::const_iterator i = uuid.begin(); i != uuid.end(); ++i)
+			h = (h ^ static_cast<unsigned char>(*i)) * 16777619U;
+		return h;
+	}
+
+	unsigned int mask() const
+	{
+		return slots.size() - 1;
+	}
+
+	/** Returns the slot holding the user, or the empty slot where they would go */
+	unsigned int probe(const std::string &uuid, uint32_t h) const
+	{
+		unsigned int i = h & mask();
+		while (slots[i].uuid[0] && (slots[i].hash != h || uuid.compare(slots[i].uuid)))
+			i = (i + 1) & mask();
+		return i;
+	}
+
+	void resize(unsigned int size)
+	{
+		std::vector<Slot> old(size);
+		old.swap(slots);
+		for (unsigned int i = 0; i < slots.size(); ++i)
+			slots[i].uuid[0] = 0;
+		for (typename std::vector<Slot>::const_iterator i = old.begin(); i != old.end(); ++i)
+		{
+			if (!i->uuid[0])
+				continue;
+			unsigned int j = i->hash & mask();
+			while (slots[j].uuid[0])
+				j = (j + 1) & mask();
+			slots[j] = *i;
+		}
+		victim = 0;
+	}
+
+ public:
+	UserTable() : count(0), victim(0)
+	{
+	}
+
+	Value *find(User *user)
+	{
+		if (!count)
+			return NULL;
+		unsigned int i = probe(user->uuid, hashOf(user->uuid));
+		return slots[i].uuid[0] ? &slots[i].value : NULL;
+	}
+
+	/** Returns the user's entry, adding a default-constructed one if there is none.
+	 * The reference is only good until the table is next changed.
+	 */
+	Value &get(User *user)
+	{
+		uint32_t h = hashOf(user->uuid);
+		if (count)
+		{
+			unsigned int i = probe(user->uuid, h);
+			if (slots[i].uuid[0])
+				return slots[i].value;
+		}
+
+		// Keep the table at most half full
+		if (count >= MAX_ENTRIES)
+		{
+			while (!slots[victim & mask()].uuid[0])
+				victim++;
+			eraseAt(victim++ & mask());
+		}
+		else if ((count + 1) * 2 > slots.size())
+		{
+			resize(std::max<unsigned int>(slots.size() * 2, 16));
+		}
+
+		unsigned int i = probe(user->uuid, h);
+		slots[i].hash = h;
+		user->uuid.copy(slots[i].uuid, UUID_LENGTH - 1);
+		slots[i].uuid[std::min<size_t>(user->uuid.size(), UUID_LENGTH - 1)] = 0;
+		slots[i].value = Value();
+		count++;
+		return slots[i].value;
+	}
+
+	void erase(User *user)
+	{
+		if (!count)
+			return;
+		unsigned int i = probe(user->uuid, hashOf(user->uuid));
+		if (slots[i].uuid[0])
+			eraseAt(i);
+	}
+
+	/** Empties a slot, moving later entries of the same probe run back so lookups need no tombstones */
+	void eraseAt(unsigned int slot)
+	{
+		unsigned int hole = slot;
+		for (unsigned int i = (slot + 1) & mask(); slots[i].uuid[0]; i = (i + 1) & mask())
+		{
+			// An entry can only move back if its home slot isn't between the hole and where it is now
+			unsigned int home = slots[i].hash & mask();
+			if (((i - home) & mask()) >= ((i - hole) & mask()))
+			{
+				slots[hole] = slots[i];
+				hole = i;
+			}
+		}
+		slots[hole].uuid[0] = 0;
+		count--;
+	}
+
+	void clear()
+	{
+		slots.clear();
+		count = 0;
+		victim = 0;
+	}
+
+	unsigned int size() const
+	{
+		return count;
+	}
+
+	/** Number of slots, for walking the table with at() */
+	unsigned int capacity() const
+	{
+		return slots.size();
+	}
+
+	/** Returns the entry in a slot, or NULL if the slot is empty */
+	Value *at(unsigned int slot)
+	{
+		return slots[slot].uuid[0] ? &slots[slot].value : NULL;
+	}
+};
+/* END shared/usertable.h */
 
-    slmodsettings(int b, int c) : secs(b), lines(c)
-    {
-        reset = ServerInstance->Time() + secs;
-    }
+/* BEGIN shared/ratelimit.h: edit that file and run ./sync-shared */
+/** A limit of some number of lines or bytes every secs seconds, as set by a channel mode */
+class ratelimit
+{
+ public:
+	unsigned int limit;
+	unsigned int secs;
+
+	ratelimit(unsigned int Limit, unsigned int Secs) : limit(Limit), secs(Secs)
+	{
+	}
+
+	/** The window things are counted over, in milliseconds */
+	unsigned long long span() const
+	{
+		return secs * 1000ULL;
+	}
+
+	/** Reads a mode parameter of the form <limit>:<secs>, returning false if it isn't valid */
+	bool parse(const std::string &str)
+	{
+		std::string::size_type colon = str.find(':');
+		if ((colon == std::string::npos) || (str.find('-') != std::string::npos))
+			return false;
+
+		limit = ConvToInt(str.substr(0, colon));
+		secs = ConvToInt(str.substr(colon + 1));
+		return ((limit >= 2) && (secs >= 1));
+	}
+
+	std::string str() const
+	{
+		return ConvToStr(limit) + ":" + ConvToStr(secs);
+	}
+
+	/** The current time in milliseconds */
+	static unsigned long long now()
+	{
+		return ServerInstance->Time() * 1000ULL + ServerInstance->Time_ns() / 1000000;
+	}
+};
 
-    bool addmessage(User* who)
-    {
-        if (ServerInstance->Time() > reset)
-        {
-            counters.clear();
-            reset = ServerInstance->Time() + secs;
-        }
+/* Window policies for ratelimiter. Each keeps a state per key and a clock shared by every key of
+ * a limiter, and provides:
+ *	start(clock, now, rate)               once, when the limiter is made
+ *	advance(clock, now, rate)             before every count
+ *	add(state, clock, now, rate, amount)  counts amount, returns true if the key is now at the limit
+ *	idle(state, clock, now, rate)         whether the state no longer matters and can be forgotten
+ * A new state is default constructed. Times are in milliseconds, see ratelimit::now().
+ */
 
-        return (++counters[who] >= this->lines);
-    }
+/** Counts in windows of secs shared by every key, the first starting with the limiter.
+ *
+ * A window ends once the second it was due to end in is over. Counts from before the current
+ * window are left in place and read as zero, rather than clearing every count when it ends.
+ */
+struct fixedwindow
+{
+	struct clock
+	{
+		unsigned long epoch;
+		/* The second the current window ends with */
+		unsigned long long reset;
+	};
+
+	struct state
+	{
+		unsigned long epoch;
+		unsigned long long count;
+
+		state() : epoch(0), count(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		c.epoch = 0;
+		c.reset = now / 1000 + rate.secs;
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		if (now / 1000 > c.reset)
+		{
+			c.epoch++;
+			c.reset = now / 1000 + rate.secs;
+		}
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		if (s.epoch != c.epoch)
+		{
+			s.epoch = c.epoch;
+			s.count = 0;
+		}
+		s.count += amount;
+		return (s.count >= rate.limit);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		return (s.epoch != c.epoch);
+	}
+};
 
-    void clear(User* who)
-    {
-        std::map<User*, unsigned int>::iterator iter = counters.find(who);
-        if (iter != counters.end())
-        {
-            counters.erase(iter);
-        }
-    }
+/** Counts in windows of secs that start with the first count rather than on a shared boundary.
+ *
+ * The count for the last secs is estimated from the current window plus the part of the previous
+ * window that still overlaps it, so a burst across a window boundary still counts.
+ */
+struct slidingwindow
+{
+	struct clock
+	{
+	};
+
+	struct state
+	{
+		/* Start of the current window */
+		unsigned long long start;
+		unsigned long long current;
+		unsigned long long previous;
+
+		state() : start(0), current(0), previous(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		unsigned long long span = rate.span();
+		if (idle(s, c, now, rate))
+		{
+			s.start = now;
+			s.current = s.previous = 0;
+		}
+		else if (now - s.start >= span)
+		{
+			s.start += span;
+			s.previous = s.current;
+			s.current = 0;
+		}
+		s.current += amount;
+
+		/* The previous window's count is taken to be spread evenly over it. The overlap leaves
+		 * out its first millisecond, which is no longer in the last span, so users who speak on a
+		 * timer at just under the limit don't trip it at every window boundary. */
+		unsigned long long overlap = span - (now - s.start) - 1;
+		return (s.previous * overlap / span + s.current >= rate.limit);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		return (now - s.start >= 2 * rate.span());
+	}
+};
+
+/** Lets limit through at once, then limit more every secs as the bucket drains.
+ *
+ * Each line or byte adds span to the level, which drains by limit every millisecond, so the key
+ * is at the limit once the level reaches limit * span. What is counted beyond that is dropped
+ * rather than kept as debt, so a key that stops is let through again within secs.
+ */
+struct tokenbucket
+{
+	struct clock
+	{
+		/* limit * span, or as much as fits */
+		unsigned long long full;
+		/* Longest time that can be multiplied by limit without overflowing */
+		unsigned long long longest;
+	};
+
+	struct state
+	{
+		unsigned long long level;
+		unsigned long long last;
+
+		state() : level(0), last(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		unsigned long long most = ~0ULL;
+		unsigned long long span = rate.span();
+		c.full = (rate.limit && span > most / rate.limit) ? most : rate.limit * span;
+		c.longest = rate.limit ? most / rate.limit : most;
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		unsigned long long elapsed = now - s.last;
+		if (s.level)
+		{
+			if (elapsed > c.longest || elapsed * rate.limit >= s.level)
+				s.level = 0;
+			else
+				s.level -= elapsed * rate.limit;
+		}
+		s.last = now;
+
+		unsigned long long cost = amount * rate.span();
+		s.level = (cost >= c.full - s.level) ? c.full : s.level + cost;
+		return (s.level >= c.full);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		unsigned long long elapsed = now - s.last;
+		return (elapsed > c.longest || elapsed * rate.limit >= s.level);
+	}
+};
+
+/* Scope policies for ratelimiter, which decide what a count belongs to */
+
+/** Counts each local user on their own, forgetting idle users a couple at a time as counts come in */
+struct peruser
+{
+	template<typename Window>
+	class keys
+	{
+		UserTable<typename Window::state> states;
+		/* Slot of states that idle users are checked for from */
+		unsigned int cursor;
+
+	 public:
+		keys() : cursor(0)
+		{
+		}
+
+		typename Window::state &get(User *who)
+		{
+			return states.get(who);
+		}
+
+		void forget(User *who)
+		{
+			states.erase(who);
+		}
+
+		unsigned int size() const
+		{
+			return states.size();
+		}
+
+		void expire(const typename Window::clock &c, unsigned long long now, const ratelimit &rate)
+		{
+			for (unsigned int i = 0; i < 2 && states.size(); ++i)
+			{
+				if (cursor >= states.capacity())
+					cursor = 0;
+				typename Window::state *s = states.at(cursor);
+				// Erasing can move the next entry into this slot, so it is looked at again
+				if (s && Window::idle(*s, c, now, rate))
+					states.eraseAt(cursor);
+				else
+					++cursor;
+			}
+		}
+	};
+};
+
+/** Counts everything in the channel together */
+struct perchannel
+{
+	template<typename Window>
+	class keys
+	{
+		typename Window::state state;
+
+	 public:
+		typename Window::state &get(User *who)
+		{
+			return state;
+		}
+
+		void forget(User *who)
+		{
+		}
+
+		unsigned int size() const
+		{
+			return 1;
+		}
+
+		void expire(const typename Window::clock &c, unsigned long long now, const ratelimit &rate)
+		{
+		}
+	};
+};
+
+/* Measure policies for ratelimiter, which decide how much a message counts for */
+
+struct countlines
+{
+	static unsigned long long amount(const std::string &text)
+	{
+		return 1;
+	}
+};
+
+struct countbytes
+{
+	static unsigned long long amount(const std::string &text)
+	{
+		return text.length();
+	}
+};
+
+/** Limits what is said in a channel, with the policies picked at compile time so that each mode
+ * only pays for what it uses: fixedwindow, slidingwindow or tokenbucket; peruser or perchannel;
+ * countlines or countbytes.
+ */
+template<typename Window, typename Scope, typename Measure>
+class ratelimiter : public ratelimit
+{
+	typename Window::clock clock;
+	typename Scope::template keys<Window> keys;
+
+	bool count(User *who, unsigned long long amount)
+	{
+		unsigned long long t = now();
+		Window::advance(clock, t, *this);
+		keys.expire(clock, t, *this);
+		return Window::add(keys.get(who), clock, t, *this, amount);
+	}
+
+ public:
+	ratelimiter(const ratelimit &rate) : ratelimit(rate)
+	{
+		Window::start(clock, now(), *this);
+	}
+
+	/** Counts a message, returning true if that brings its sender, or the channel, to the limit */
+	bool add(User *who, const std::string &text)
+	{
+		return count(who, Measure::amount(text));
+	}
+
+	/** Counts lines or bytes sent somewhere else, e.g. on another server */
+	void addamount(User *who, unsigned long long amount)
+	{
+		count(who, amount);
+	}
+
+	/** Returns true if the sender, or the channel, is at the limit already */
+	bool full(User *who)
+	{
+		return count(who, 0);
+	}
+
+	void forget(User *who)
+	{
+		keys.forget(who);
+	}
+
+	/** Number of counts kept, for one channel */
+	unsigned int size() const
+	{
+		return keys.size();
+	}
 };
+/* END shared/ratelimit.h */
+
+/** Holds flag settings and state for mode +U, each local user's lines in windows the channel shares
+ */
+typedef ratelimiter<fixedwindow, peruser, countlines> slmodsettings;
 
 /** Handles channel mode +U
  */
@@ -82,30 +598,21 @@ public:
     {
         if (adding)
         {
-            std::string::size_type colon = parameter.find(':');
-            if ((colon == std::string::npos) || (parameter.find('-') != std::string::npos))
-            {
-                source->WriteNumeric(608, "%s %s :Invalid slowmode parameter",source->nick.c_str(),channel->name.c_str());
-                return MODEACTION_DENY;
-            }
-
             /* Set up the slowmode parameters for this channel */
-            unsigned int nlines = ConvToInt(parameter.substr(0, colon));
-            unsigned int nsecs = ConvToInt(parameter.substr(colon+1));
-
-            if ((nlines<2) || (nsecs<1))
+            ratelimit rate(0, 0);
+            if (!rate.parse(parameter))
             {
                 source->WriteNumeric(608, "%s %s :Invalid slowmode parameter",source->nick.c_str(),channel->name.c_str());
                 return MODEACTION_DENY;
             }
 
             slmodsettings* f = ext.get(channel);
-            if ((f) && (nlines == f->lines) && (nsecs == f->secs))
+            if ((f) && (rate.limit == f->limit) && (rate.secs == f->secs))
                 // mode params match
                 return MODEACTION_DENY;
 
-            ext.set(channel, new slmodsettings(nsecs, nlines));
-            parameter = std::string("") + ConvToStr(nlines) + ":" + ConvToStr(nsecs);
+            ext.set(channel, new slmodsettings(rate));
+            parameter = rate.str();
             channel->SetModeParam('U', parameter);
             return MODEACTION_ALLOW;
         }
@@ -121,14 +628,61 @@ public:
     }
 };
 
+/* Reported as ircd_slowmode, see the top of m_telegraf.cpp */
+struct TelegrafMetric
+{
+    enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+    const char *name;
+    int type;
+    long long value;
+    unsigned long long *buckets;
+};
+
+struct TelegrafMetrics
+{
+    enum { MAGIC = 0x54474d53, VERSION = 1, BUCKETS = 64 };
+
+    unsigned int magic;
+    unsigned int version;
+    unsigned int count;
+    TelegrafMetric *metrics;
+};
+
+class SlowModeMetrics : public DataProvider
+{
+public:
+    TelegrafMetrics telegraf;
+    TelegrafMetric messages;
+
+    SlowModeMetrics(Module* Creator)
+            : DataProvider(Creator, "telegraf/slowmode")
+    {
+        messages.name = "throttled";
+        messages.type = TelegrafMetric::COUNTER;
+        messages.value = 0;
+        messages.buckets = NULL;
+        telegraf.magic = TelegrafMetrics::MAGIC;
+        telegraf.version = TelegrafMetrics::VERSION;
+        telegraf.count = 1;
+        telegraf.metrics = &messages;
+    }
+
+    void throttled()
+    {
+        messages.value++;
+    }
+};
+
 class ModuleSlowMode : public Module
 {
     SlowMode ml;
+    SlowModeMetrics metrics;
 
 public:
 
     ModuleSlowMode()
-            : ml(this)
+            : ml(this), metrics(this)
     {
     }
 
@@ -136,7 +690,8 @@ public:
     {
         ServerInstance->Modules->AddService(ml);
         ServerInstance->Modules->AddService(ml.ext);
-        Implementation eventlist[] = { I_OnUserPreNotice, I_OnUserPreMessage };
+        ServerInstance->Modules->AddService(metrics);
+        Implementation eventlist[] = { I_OnUserPreNotice, I_OnUserPreMessage, I_OnUserQuit, I_OnUserPart, I_OnUserKick };
         ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
     }
 
@@ -153,11 +708,12 @@ public:
 
         if (f)
         {
-            if (f->addmessage(user))
+            if (f->add(user, text))
             {
+                metrics.throttled();
                 /* Simply deny to send the message. */
                 char warnMessage[MAXBUF];
-                snprintf(warnMessage, MAXBUF, "Cannot send message to channel. You are throttled. You may not send %u or more lines in less than %u seconds.", f->lines, f->secs);
+                snprintf(warnMessage, MAXBUF, "Cannot send message to channel. You are throttled. You may not send %u or more lines in less than %u seconds.", f->limit, f->secs);
 
                 user->WriteNumeric(404, "%s %s :%s", user->nick.c_str(), chan->name.c_str(), warnMessage);
 
@@ -184,6 +740,34 @@ public:
         return MOD_RES_PASSTHRU;
     }
 
+    void Forget(User* user, Channel* chan)
+    {
+        slmodsettings *f = ml.ext.get(chan);
+        if (f)
+            f->forget(user);
+    }
+
+    void OnUserQuit(User* user, const std::string &message, const std::string &oper_message)
+    {
+        if (!IS_LOCAL(user))
+            return;
+
+        for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+            Forget(user, *i);
+    }
+
+    void OnUserPart(Membership* memb, std::string &partmessage, CUList &except_list)
+    {
+        if (IS_LOCAL(memb->user))
+            Forget(memb->user, memb->chan);
+    }
+
+    void OnUserKick(User* source, Membership* memb, const std::string &reason, CUList &except_list)
+    {
+        if (IS_LOCAL(memb->user))
+            Forget(memb->user, memb->chan);
+    }
+
     void Prioritize()
     {
         // we want to be after all modules that might deny the message (e.g. m_muteban, m_noctcp, m_blockcolor, etc.)
@@ -8,22 +8,140 @@
  * 			Register Timer
  *
  * 		From Loop:
- * 			LoopLagTimer::Tick
- * 			OnBackgroundtimer (~every 5 secs)
+ * 			LoopLagTimer::Tick (every second, flushes if due)
+ * 			FlushTimer::HandleEvent (every interval, Linux only, flushes if due)
+ * 			LoopProbe::HandleEvent (trial write, if sampleiterations is set)
  * 			Socket reads/module calls
+ * 			CullMarker::cull (if sampleiterations is set)
+ * 			Other culls
  * 			LoopAction::Call
+ * 			PhaseAction::Call (if sampleiterations is set)
+ * 			Other atomic actions
+ * 			IterationAction::Call (if sampleiterations is set)
  *
- * 	Data fields can be added in TelegrafSocket::SendMetrics
+ * 	Data fields can be added in TelegrafModule::GetMetrics, they are exported to both Telegraf and Prometheus
+ * 	How long local users take from accept to each stage of registration is reported as ircd_registration,
+ * 	along with how many registered without a stage being seen
+ * 	Every other server is reported as ircd_link, with sendq and burst details for the ones linked to us
+ * 	Other modules can publish their own metrics as ircd_<measurement>. This is the contract they follow,
+ * 	and each copies the two structs below unchanged, so it still builds and installs on its own:
+ *
+ * 		struct TelegrafMetric
+ * 		{
+ * 			enum Type { COUNTER, GAUGE, HISTOGRAM };
+ *
+ * 			const char *name;
+ * 			int type;
+ * 			long long value;
+ * 			unsigned long long *buckets;
+ * 		};
+ *
+ * 		struct TelegrafMetrics
+ * 		{
+ * 			enum { MAGIC = 0x54474d53, VERSION = 1, BUCKETS = 64 };
+ *
+ * 			unsigned int magic;
+ * 			unsigned int version;
+ * 			unsigned int count;
+ * 			TelegrafMetric *metrics;
+ * 		};
+ *
+ * 	The module adds a data service named "telegraf/<measurement>" whose first member is a TelegrafMetrics,
+ * 	with magic and version set to MAGIC and VERSION and metrics pointing at count metrics. m_telegraf reads
+ * 	the first member as a TelegrafMetrics and skips the service unless magic and version match, so a new
+ * 	layout has to come with a new VERSION. On every flush each metric is reported by its type:
+ * 		COUNTER, value is the total since the module loaded
+ * 		GAUGE, value is the current value, which may be negative
+ * 		HISTOGRAM, buckets points at BUCKETS counts. A value of 0 is counted in bucket 0, anything else in
+ * 		the bucket of its bit length, and values of 2^62 and up in the last. These are reported as
+ * 		<name>_count, <name>_p50 and <name>_p99, and m_telegraf empties the buckets after every flush.
+ * 	Names end up in both Telegraf and Prometheus, so they should be lowercase words joined by '_'.
  *
  * 	Config:
  * 		<module name="m_telegraf.so">
  * 		<telegraf
- * 			# Port Telegraf is listening on
+ * 			How often to flush metrics, in seconds or, with an "ms" suffix, milliseconds. Intervals
+ * 			below a second need Linux, elsewhere flushes happen at most once a second.
+ * 			interval="5"
+ * 			How to reach Telegraf: "tcp", "udp" or "unixgram". The datagram transports never
+ * 			queue inside the ircd; whatever does not fit in the socket buffer is dropped.
+ * 			transport="tcp"
+ * 			Address and port Telegraf is listening on for tcp and udp
+ * 			host="127.0.0.1"
  * 			port="8094"
+ * 			Socket Telegraf is listening on for unixgram
+ * 			path="/var/run/telegraf.sock"
+ * 			Largest datagram to send, lines are packed into datagrams up to this size
+ * 			(defaults to 1400 for udp, 8192 for unixgram)
+ * 			mtu="1400"
+ * 			Largest amount of data to queue for tcp before dropping flushes
+ * 			sendq="1048576"
  * 			Whether to announce the start and stop of metrics with a snotice
  * 			silent="false"
- * 			How often to attempt to reconnect to Telegraf after losing connection
- * 			reconnect="60">
+ * 			How long to wait before the first attempt to reconnect to Telegraf after losing the
+ * 			connection. The wait doubles, with some jitter, after every failed attempt up to maxreconnect.
+ * 			reconnect="60"
+ * 			maxreconnect="1800"
+ * 			While Telegraf can't be reached, flushes are kept in memory up to spoolsize bytes. Past
+ * 			that the oldest are moved to spoolfile, if set, up to spoolfilesize bytes. The backlog is
+ * 			replayed at up to replayrate bytes per flush once Telegraf is back. Set spoolsize to 0
+ * 			and leave spoolfile unset to drop metrics while disconnected instead.
+ * 			spoolsize="1048576"
+ * 			spoolfile="data/telegraf.spool"
+ * 			spoolfilesize="67108864"
+ * 			replayrate="65536"
+ * 			Also write every flush to this file, which can be loaded into InfluxDB with stock tools.
+ * 			This works with or without a Telegraf transport configured. The file is rotated once it
+ * 			would grow past archivesize bytes or is archiveinterval seconds old, keeping archivekeep
+ * 			old files as archive.1, archive.2 and so on. Set archivesize or archiveinterval to 0 to
+ * 			not rotate on size or age.
+ * 			archive="data/telegraf.lp"
+ * 			archivesize="67108864"
+ * 			archiveinterval="86400"
+ * 			archivekeep="7"
+ * 			Whether to sample the wall and CPU time of every main loop iteration, and how much
+ * 			of it went to timers, socket event dispatch, culls and atomic actions
+ * 			sampleiterations="false"
+ * 			Whether to time command handlers and report them as ircd_command
+ * 			commandstats="true"
+ * 			Whether to time each module's hooks for the most common events and report
+ * 			them as ircd_module_hook. This costs two clock reads per module per event.
+ * 			hookprofiler="false"
+ * 			Report main loop iterations, command handlers and module hooks that take this many
+ * 			milliseconds or longer as ircd_stall events, and keep the last 32 for /TELEGRAF stalls.
+ * 			Each event is timestamped with when it was recorded, so none overwrite each other.
+ * 			Iterations are only checked with sampleiterations, commands with commandstats and hooks
+ * 			with hookprofiler. Set to 0 to disable.
+ * 			stallthreshold="500"
+ * 			Whether to also announce stalls with a snotice, at most one a second
+ * 			stallsnotice="false"
+ * 			Report the channels sending the most messages and bytes to their members, and the local
+ * 			users sending the most messages, as this many ircd_top lines each per flush (up to 32).
+ * 			Counts are approximate, each line carries the most it may be overcounted by as error.
+ * 			toptalkers="0"
+ * 			Name of the server that merges the metrics of the whole network. Every server with this
+ * 			set sends it a small summary each flush over ENCAP: a few gauges and the buckets of the
+ * 			main loop histograms. That server reports each server's summary as ircd_network_server
+ * 			and the network totals, with percentiles over the merged histograms, as ircd_network.
+ * 			Servers that are not heard from for a minute are left out. Set this on the aggregating
+ * 			server too. Only it needs a Telegraf transport.
+ * 			aggregateto="hub.example.net"
+ * 			Collectors that are costly to run, which run every expensiveinterval instead of on every
+ * 			flush. The collectors are "loop", the main loop histograms (and the summary sent to
+ * 			aggregateto), "commands", "hooks", "whowas", which walks the whole whowas table, and
+ * 			"process", which reports the ircd's own CPU, memory and heap use as ircd_process. The
+ * 			last whowas and process values are reported in between, the others accumulate until
+ * 			they next run. <name>interval sets the interval of a single collector, 0 meaning every
+ * 			flush. Collectors that don't run every flush are spread over different flushes.
+ * 			expensive="whowas process"
+ * 			expensiveinterval="60"
+ * 			processinterval="30"
+ * 			Serve the same metrics in the Prometheus text format at /metrics on a local port or
+ * 			unix socket. The response is rendered once per flush and cached between scrapes.
+ * 			This works with or without a Telegraf transport configured.
+ * 			prometheushost="127.0.0.1"
+ * 			prometheusport="9105"
+ * 			prometheuspath="/var/run/inspircd-metrics.sock">
  */
 
 /* $ModDesc: Provides IRCd metrics to a locally running Telegraf instance. */
@@ -33,173 +151,3252 @@
 
 #include "inspircd.h"
 #include "commands/cmd_whowas.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static const std::string cmd_actions[] = {"start", "stop", "restart", "status", "sample", "stalls"};
+
+/* Events timed by the hook profiler, see HookProbe */
+static const Implementation profiled_events[] = {
+	I_OnUserPreMessage, I_OnUserPreNotice, I_OnUserMessage, I_OnUserNotice, I_OnPreCommand, I_OnPostCommand,
+	I_OnUserPreJoin, I_OnUserJoin, I_OnUserPart, I_OnUserQuit, I_OnUserPreNick, I_OnCheckBan, I_OnRawMode,
+	I_OnUserConnect, I_OnCheckReady, I_OnBackgroundTimer
+};
+static const char *const profiled_event_names[] = {
+	"OnUserPreMessage", "OnUserPreNotice", "OnUserMessage", "OnUserNotice", "OnPreCommand", "OnPostCommand",
+	"OnUserPreJoin", "OnUserJoin", "OnUserPart", "OnUserQuit", "OnUserPreNick", "OnCheckBan", "OnRawMode",
+	"OnUserConnect", "OnCheckReady", "OnBackgroundTimer"
+};
+static const unsigned int PROFILED_EVENT_COUNT = sizeof(profiled_events) / sizeof(profiled_events[0]);
+
+/** 32-bit FNV-1a hash, used to index names into fixed-size tables */
+static uint32_t hashName(const std::string &name)
+{
+	uint32_t h = 2166136261U;
+	for (std::string::const_iterator i = name.begin(); i != name.end(); ++i)
+	{
+		h ^= static_cast<unsigned char>(*i);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/** Returns a monotonic wall clock timestamp in microseconds */
+static unsigned long long monotonicMicros()
+{
+#ifdef HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+/** Returns the wall clock time in nanoseconds since the epoch */
+static unsigned long long wallNanos()
+{
+#ifdef HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+/** Returns the CPU time used by the whole process in microseconds, as main_loop_time has always been measured */
+static unsigned long long processCpuMicros()
+{
+	return static_cast<unsigned long long>(std::clock()) * 1000000 / CLOCKS_PER_SEC;
+}
+
+/** Returns the CPU time used by the main thread in microseconds */
+static unsigned long long cpuMicros()
+{
+#if defined HAS_CLOCK_GETTIME && defined CLOCK_THREAD_CPUTIME_ID
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	return static_cast<unsigned long long>(std::clock()) * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+/** Fixed-memory, log-bucketed latency histogram in the spirit of HdrHistogram.
+ *
+ * Values (in microseconds) below SUB_COUNT are counted exactly. Above that, each
+ * power of two is split into SUB_HALF linear sub-buckets, which bounds the
+ * relative error of any reported percentile to 1/SUB_HALF (~6%).
+ */
+class LatencyHistogram
+{
+ public:
+	static const unsigned int SUB_BITS = 5;
+	static const unsigned int SUB_COUNT = 1 << SUB_BITS;
+	static const unsigned int SUB_HALF = SUB_COUNT / 2;
+	static const unsigned int BUCKETS = (32 - SUB_BITS) * SUB_HALF + SUB_COUNT;
+
+ private:
+	uint32_t buckets[BUCKETS];
+	unsigned long count;
+	unsigned long long total;
+	uint32_t max;
+
+	static unsigned int highestBit(uint32_t v)
+	{
+#ifdef __GNUC__
+		return 31 - __builtin_clz(v);
+#else
+		unsigned int bit = 0;
+		while (v >>= 1)
+			bit++;
+		return bit;
+#endif
+	}
+
+ public:
+	LatencyHistogram()
+	{
+		reset();
+	}
+
+	static unsigned int bucketFor(uint32_t v)
+	{
+		if (v < SUB_COUNT)
+			return v;
+		unsigned int shift = highestBit(v) - SUB_BITS + 1;
+		return shift * SUB_HALF + (v >> shift);
+	}
+
+	/** Returns the highest value that is counted in the given bucket */
+	static uint32_t bucketUpper(unsigned int idx)
+	{
+		if (idx < SUB_COUNT)
+			return idx;
+		unsigned int shift = idx / SUB_HALF - 1;
+		uint64_t sub = idx - shift * SUB_HALF;
+		return static_cast<uint32_t>(((sub + 1) << shift) - 1);
+	}
+
+	void reset()
+	{
+		memset(buckets, 0, sizeof(buckets));
+		count = 0;
+		total = 0;
+		max = 0;
+	}
+
+	void add(unsigned long long us)
+	{
+		uint32_t v = us > 0xFFFFFFFFULL ? 0xFFFFFFFFU : static_cast<uint32_t>(us);
+		buckets[bucketFor(v)]++;
+		count++;
+		total += v;
+		if (v > max)
+			max = v;
+	}
+
+	unsigned long getCount() const
+	{
+		return count;
+	}
+
+	uint32_t getMax() const
+	{
+		return max;
+	}
+
+	uint32_t getBucket(unsigned int idx) const
+	{
+		return buckets[idx];
+	}
+
+	/** Adds the counts of a bucket of another histogram, e.g. one received from another server */
+	void mergeBucket(unsigned int idx, uint32_t n)
+	{
+		if (idx < BUCKETS)
+			buckets[idx] += n;
+	}
+
+	/** Adds the totals of another histogram, see mergeBucket() */
+	void mergeTotals(unsigned long n, unsigned long long sum, uint32_t largest)
+	{
+		count += n;
+		total += sum;
+		if (largest > max)
+			max = largest;
+	}
+
+	unsigned long long getTotal() const
+	{
+		return total;
+	}
+
+	unsigned long long getMean() const
+	{
+		return count ? total / count : 0;
+	}
+
+	/** Returns the value at the given quantile (0 < q <= 1), clamped to the largest value seen */
+	uint32_t percentile(double q) const
+	{
+		if (!count)
+			return 0;
+		unsigned long target = static_cast<unsigned long>(q * count + 0.5);
+		if (target < 1)
+			target = 1;
+		unsigned long seen = 0;
+		for (unsigned int i = 0; i < BUCKETS; ++i)
+		{
+			seen += buckets[i];
+			if (seen >= target)
+				return std::min(bucketUpper(i), max);
+		}
+		return max;
+	}
+};
+
+/** Maps names to slots of a fixed-size array through a small open-addressing index.
+ *
+ * Names get a slot the first time they are seen. Names seen after the array is full all share
+ * the last slot, named "*". Slots must be a power of two.
+ */
+template <unsigned int Slots>
+class NameIndex
+{
+ public:
+	static const unsigned int OVERFLOW_SLOT = Slots - 1;
+
+ private:
+	static const unsigned int INDEX_SIZE = Slots * 2;
+
+	std::string names[Slots];
+	unsigned int used;
+	int index[INDEX_SIZE];
+	uint32_t hashes[INDEX_SIZE];
+
+ public:
+	NameIndex() : used(0)
+	{
+		for (unsigned int i = 0; i < INDEX_SIZE; ++i)
+			index[i] = -1;
+		names[OVERFLOW_SLOT] = "*";
+	}
+
+	unsigned int find(const std::string &name)
+	{
+		uint32_t h = hashName(name);
+		for (unsigned int slot = h & (INDEX_SIZE - 1);; slot = (slot + 1) & (INDEX_SIZE - 1))
+		{
+			if (index[slot] < 0)
+			{
+				if (used == OVERFLOW_SLOT)
+					return OVERFLOW_SLOT;
+				index[slot] = used;
+				hashes[slot] = h;
+				names[used] = name;
+				return used++;
+			}
+			if (hashes[slot] == h && names[index[slot]] == name)
+				return index[slot];
+		}
+	}
+
+	const std::string &name(unsigned int slot) const
+	{
+		return names[slot];
+	}
+};
+
+/** Call counts and handler latency per command.
+ *
+ * Commands are assigned a slot in a fixed-size array the first time they are seen, so timing
+ * a command never touches a string map.
+ */
+class CommandStats
+{
+ public:
+	static const unsigned int MAX_COMMANDS = 128;
+	static const unsigned int MAX_DEPTH = 8;
+
+	struct Entry
+	{
+		unsigned long long total;
+		LatencyHistogram latency;
+	};
+
+ private:
+	NameIndex<MAX_COMMANDS> names;
+	Entry entries[MAX_COMMANDS];
+
+	/* Commands may be nested, e.g. by aliases */
+	unsigned int pendingEntry[MAX_DEPTH];
+	unsigned long long pendingStart[MAX_DEPTH];
+	unsigned int depth;
+
+ public:
+	/** Commands timed since load, which reset() leaves alone */
+	unsigned long long finished;
+
+	CommandStats() : depth(0), finished(0)
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		for (unsigned int i = 0; i < MAX_COMMANDS; ++i)
+		{
+			entries[i].total = 0;
+			entries[i].latency.reset();
+		}
+	}
+
+	void start(const std::string &name, unsigned long long now)
+	{
+		if (depth < MAX_DEPTH)
+		{
+			pendingEntry[depth] = names.find(name);
+			pendingStart[depth] = now;
+		}
+		depth++;
+	}
 
-static const std::string cmd_actions[] = {"start", "stop", "restart", "status", "sample"};
+	/** Forgets the innermost command started, for one that will never finish */
+	void abandon()
+	{
+		if (depth)
+			depth--;
+	}
+
+	/** Returns how long the command took, or 0 if it was not timed */
+	unsigned long long finish(const std::string &name, unsigned long long now)
+	{
+		if (!depth)
+			return 0;
+		if (--depth >= MAX_DEPTH)
+			return 0;
+
+		unsigned int slot = pendingEntry[depth];
+		if (slot != names.OVERFLOW_SLOT && names.name(slot) != name)
+		{
+			// A post-command hook went missing somewhere, resynchronise
+			depth = 0;
+			return 0;
+		}
+		unsigned long long elapsed = now - pendingStart[depth];
+		entries[slot].total += elapsed;
+		entries[slot].latency.add(elapsed);
+		finished++;
+		return elapsed;
+	}
+
+	unsigned int size() const
+	{
+		return MAX_COMMANDS;
+	}
+
+	const std::string &name(unsigned int slot) const
+	{
+		return names.name(slot);
+	}
+
+	const Entry &operator[](unsigned int slot) const
+	{
+		return entries[slot];
+	}
+};
+
+/** How long local users took to get through each stage of registration.
+ *
+ * Every stage is timed from when the connection was accepted, so the stages of one connection
+ * add up instead of having to be chained, and the order they complete in does not matter.
+ */
+class RegistrationStats
+{
+ public:
+	enum Stage
+	{
+		/* The first line was read, i.e. the TLS handshake, if any, has finished */
+		STAGE_FIRST_LINE,
+		/* Both NICK and USER were received */
+		STAGE_NICKUSER,
+		/* The hostname lookup finished, as seen by the next hook that ran */
+		STAGE_DNS,
+		/* Every module, e.g. ident, was ready for the user to register */
+		STAGE_MODULES,
+		/* The user is fully registered */
+		STAGE_REGISTERED,
+		STAGE_COUNT
+	};
+
+	/** Where a single connection is in registration, kept on the user until it registers */
+	struct Progress
+	{
+		unsigned long long accepted;
+		unsigned int seen;
+
+		Progress(unsigned long long now) : accepted(now), seen(0)
+		{
+		}
+	};
+
+	LatencyHistogram stages[STAGE_COUNT];
+	/* Connections that registered without this stage being seen, e.g. with no hostname lookup */
+	unsigned long skipped[STAGE_COUNT];
+	unsigned long aborted;
+
+	RegistrationStats()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		for (unsigned int i = 0; i < STAGE_COUNT; ++i)
+		{
+			stages[i].reset();
+			skipped[i] = 0;
+		}
+		aborted = 0;
+	}
+
+	/** Counts the stages a connection that just registered was never seen to reach */
+	void finish(const Progress &progress)
+	{
+		for (unsigned int stage = 0; stage < STAGE_COUNT; ++stage)
+			if (!(progress.seen & (1 << stage)))
+				skipped[stage]++;
+	}
+
+	/** Records a stage the first time the connection reaches it */
+	void mark(Progress &progress, Stage stage, unsigned long long now)
+	{
+		if (progress.seen & (1 << stage))
+			return;
+		progress.seen |= 1 << stage;
+		stages[stage].add(now - progress.accepted);
+	}
+
+	static const char *name(unsigned int stage)
+	{
+		static const char *const names[STAGE_COUNT] = {"first_line", "nick_user", "dns", "modules_ready", "registered"};
+		return names[stage];
+	}
+};
 
 struct Metrics
 {
-	typedef std::vector<std::clock_t> LoopTimes;
-	std::clock_t lastLoopTime;
-	LoopTimes loopTimes;
+	unsigned long long lastLoopTime;
+	LatencyHistogram loopTimes;
+	/* CPU time of the same loops, which main_loop_time reports */
+	unsigned long long lastLoopCpu;
+	LatencyHistogram loopCpuTimes;
+
+	unsigned long long lastIterationWall;
+	unsigned long long lastIterationCpu;
+	LatencyHistogram iterationWall;
+	LatencyHistogram iterationCpu;
+
+	/* Where the phases of the current iteration started, see TelegrafModule::IterationStart */
+	unsigned long long dispatchStart;
+	unsigned long long dispatchStartCpu;
+	unsigned long dispatchStartEvents;
+	unsigned long long cullsStart;
+	unsigned long long cullsStartCpu;
+	unsigned long cullsStartEvents;
+	unsigned long long actionsStart;
+
+	LatencyHistogram timersTime;
+	LatencyHistogram dispatchTime;
+	LatencyHistogram dispatchCpu;
+	LatencyHistogram cullsTime;
+	LatencyHistogram actionsTime;
+	LatencyHistogram socketEvents;
+
+	CommandStats commands;
+	RegistrationStats registration;
+
+	Metrics() : lastLoopTime(0), lastLoopCpu(0), lastIterationWall(0), lastIterationCpu(0)
+	{
+		clearPhases();
+	}
+
+	virtual ~Metrics()
+	{
+	}
+
+	void clear()
+	{
+		loopTimes.reset();
+		lastLoopTime = 0;
+		loopCpuTimes.reset();
+		lastLoopCpu = 0;
+		iterationWall.reset();
+		iterationCpu.reset();
+		lastIterationWall = 0;
+		lastIterationCpu = 0;
+		clearPhases();
+		resetPhases();
+		commands.reset();
+		registration.reset();
+	}
+
+	/** Empties the main loop histograms, see CollectorSchedule::LOOP */
+	void resetLoop()
+	{
+		loopTimes.reset();
+		loopCpuTimes.reset();
+		iterationWall.reset();
+		iterationCpu.reset();
+		resetPhases();
+	}
+
+	void clearPhases()
+	{
+		dispatchStart = dispatchStartCpu = cullsStart = cullsStartCpu = actionsStart = 0;
+		dispatchStartEvents = cullsStartEvents = 0;
+	}
+
+	void resetPhases()
+	{
+		timersTime.reset();
+		dispatchTime.reset();
+		dispatchCpu.reset();
+		cullsTime.reset();
+		actionsTime.reset();
+		socketEvents.reset();
+	}
+
+	void addLoopTime(const unsigned long long wall, const unsigned long long cpu)
+	{
+		loopTimes.add(wall - lastLoopTime);
+		loopCpuTimes.add(cpu - lastLoopCpu);
+	}
+
+	/** Adds an iteration that ended at the given time.
+	 * Returns how long the iteration kept the loop busy, leaving out the time the socket engine
+	 * spent waiting for events, or 0 if that is not known.
+	 */
+	unsigned long long addIteration(const unsigned long long wall, const unsigned long long cpu)
+	{
+		unsigned long long busy = 0;
+		if (lastIterationWall)
+		{
+			iterationWall.add(wall - lastIterationWall);
+			iterationCpu.add(cpu - lastIterationCpu);
+
+			// Only if every phase of this iteration was seen, e.g. not right after sampling was enabled
+			if (dispatchStart && cullsStart && actionsStart)
+			{
+				unsigned long long waited = cullsStart - dispatchStart;
+				waited -= std::min(waited, cullsStartCpu - dispatchStartCpu);
+				busy = wall - lastIterationWall - std::min(wall - lastIterationWall, waited);
+				timersTime.add(dispatchStart - lastIterationWall);
+				dispatchTime.add(cullsStart - dispatchStart);
+				dispatchCpu.add(cullsStartCpu - dispatchStartCpu);
+				cullsTime.add(actionsStart - cullsStart);
+				actionsTime.add(wall - actionsStart);
+				socketEvents.add(cullsStartEvents - dispatchStartEvents);
+			}
+		}
+		lastIterationWall = wall;
+		lastIterationCpu = cpu;
+		clearPhases();
+		return busy;
+	}
+};
+
+/** A main loop iteration, command handler or module hook that took longer than the stall threshold */
+struct StallEvent
+{
+	time_t when;
+	/* When it was recorded in nanoseconds since the epoch, unique within the log */
+	unsigned long long at;
+	const char *kind;
+	unsigned long long duration;
+	std::string command;
+	std::string source;
+	std::string module;
+	std::string event;
+
+	StallEvent() : when(0), at(0), kind(""), duration(0)
+	{
+	}
+
+	std::string describe() const
+	{
+		std::string text = std::string(kind) + " took " + ConvToStr(duration / 1000) + "ms";
+		if (!command.empty())
+			text += ", command " + command;
+		if (!source.empty())
+			text += " from " + source;
+		if (!module.empty())
+			text += ", module " + module;
+		if (!event.empty())
+			text += " in " + event;
+		return text;
+	}
+};
+
+/** The most recent stalls, kept in a fixed-size ring.
+ *
+ * Commands and hooks are checked against the threshold as they finish. The slowest of them in
+ * each iteration is remembered, so that a stalled iteration can name what most likely caused it.
+ */
+class StallLog
+{
+ public:
+	static const unsigned int SIZE = 32;
+
+ private:
+	StallEvent events[SIZE];
+	unsigned long recorded;
+	unsigned long flushed;
+	StallEvent culprit;
+	time_t lastNotice;
+	unsigned long long lastAt;
+
+	void fill(StallEvent &ev, const char *kind, unsigned long long duration, const std::string &module,
+			  const char *event)
+	{
+		ev.when = ServerInstance->Time();
+		ev.kind = kind;
+		ev.duration = duration;
+		ev.command = command ? *command : "";
+		User *from = source ? ServerInstance->FindUUID(*source) : NULL;
+		ev.source = from ? from->GetFullHost() : "";
+		ev.module = module;
+		ev.event = event;
+	}
+
+	StallEvent &add()
+	{
+		return events[recorded++ % SIZE];
+	}
+
+	/* Each stall is written as a point of its own, which needs a timestamp of its own */
+	void stamp(StallEvent &ev)
+	{
+		unsigned long long now = wallNanos();
+		lastAt = now > lastAt ? now : lastAt + 1;
+		ev.at = lastAt;
+	}
+
+	void announce(const StallEvent &ev)
+	{
+		// At most one a second, a struggling server doesn't need its snomask flooded as well
+		if (!notify || lastNotice == ev.when)
+			return;
+		lastNotice = ev.when;
+		ServerInstance->SNO->WriteGlobalSno('a', "METRICS: Stall: %s", ev.describe().c_str());
+	}
+
+ public:
+	/** Durations from this many microseconds up are stalls, 0 disables the log */
+	unsigned long long threshold;
+	bool notify;
+
+	/** The name of the command being handled and the UUID of who sent it, NULL outside a command */
+	const std::string *command;
+	const std::string *source;
+
+	StallLog() : recorded(0), flushed(0), lastNotice(0), lastAt(0), threshold(0), notify(false), command(NULL), source(NULL)
+	{
+	}
+
+	/** Checks a command or hook that has just finished */
+	void check(const char *kind, unsigned long long duration, const std::string &module, const char *event)
+	{
+		if (duration > culprit.duration && duration >= threshold / 4)
+			fill(culprit, kind, duration, module, event);
+		if (duration < threshold)
+			return;
+
+		StallEvent &ev = add();
+		fill(ev, kind, duration, module, event);
+		stamp(ev);
+		announce(ev);
+	}
+
+	/** Checks an iteration that has just finished and forgets its slowest command or hook */
+	void checkIteration(unsigned long long busy)
+	{
+		if (busy >= threshold)
+		{
+			StallEvent &ev = add();
+			ev = culprit;
+			ev.when = ServerInstance->Time();
+			ev.kind = "loop";
+			ev.duration = busy;
+			stamp(ev);
+			announce(ev);
+		}
+		if (culprit.duration)
+			culprit = StallEvent();
+	}
+
+	unsigned long total() const
+	{
+		return recorded;
+	}
+
+	/** Returns the number of stalls kept, which can be read with get() */
+	unsigned int size() const
+	{
+		return std::min<unsigned long>(recorded, SIZE);
+	}
+
+	/** Returns a kept stall, 0 being the most recent */
+	const StallEvent &get(unsigned int idx) const
+	{
+		return events[(recorded - 1 - idx) % SIZE];
+	}
+
+	/** Returns the number of stalls kept that have not been flushed yet */
+	unsigned int unflushed() const
+	{
+		return std::min<unsigned long>(recorded - flushed, SIZE);
+	}
+
+	void markFlushed()
+	{
+		flushed = recorded;
+	}
+};
+
+/** Approximate heaviest keys of a stream in fixed memory, using the Space-Saving algorithm.
+ *
+ * Keeps Slots counters. A key that is not counted yet takes over the smallest counter and
+ * inherits its count, which is remembered as the key's possible overestimate. Any key whose
+ * true count is above total / Slots is guaranteed to be kept.
+ */
+template <unsigned int Slots>
+class SpaceSaving
+{
+	uint32_t hashes[Slots];
+	std::string keys[Slots];
+	unsigned long long counts[Slots];
+	unsigned long long errors[Slots];
+	unsigned int used;
+
+ public:
+	SpaceSaving() : used(0)
+	{
+	}
+
+	void add(const std::string &key, unsigned long long weight)
+	{
+		uint32_t h = hashName(key);
+		for (unsigned int i = 0; i < used; ++i)
+		{
+			if (hashes[i] == h && keys[i] == key)
+			{
+				counts[i] += weight;
+				return;
+			}
+		}
+
+		unsigned int slot = used;
+		if (used < Slots)
+		{
+			used++;
+			counts[slot] = 0;
+		}
+		else
+		{
+			slot = 0;
+			for (unsigned int i = 1; i < Slots; ++i)
+			{
+				if (counts[i] < counts[slot])
+					slot = i;
+			}
+		}
+		hashes[slot] = h;
+		keys[slot] = key;
+		errors[slot] = counts[slot];
+		counts[slot] += weight;
+	}
+
+	void reset()
+	{
+		used = 0;
+	}
+
+	/** Writes the slots of the n heaviest keys to out, heaviest first, and returns how many there were */
+	unsigned int top(unsigned int n, unsigned int *out) const
+	{
+		n = std::min(n, used);
+		for (unsigned int i = 0; i < used; ++i)
+		{
+			// Insertion into the short sorted list of the heaviest so far
+			unsigned int pos = std::min(i, n);
+			while (pos > 0 && counts[out[pos - 1]] < counts[i])
+			{
+				if (pos < n)
+					out[pos] = out[pos - 1];
+				pos--;
+			}
+			if (pos < n)
+				out[pos] = i;
+		}
+		return n;
+	}
+
+	const std::string &key(unsigned int slot) const
+	{
+		return keys[slot];
+	}
+
+	unsigned long long count(unsigned int slot) const
+	{
+		return counts[slot];
+	}
+
+	unsigned long long error(unsigned int slot) const
+	{
+		return errors[slot];
+	}
+};
+
+/** The channels and local users sending the most, reset every flush */
+struct TopTalkers
+{
+	static const unsigned int SLOTS = 64;
+	static const unsigned int MAX_REPORTED = 32;
+
+	/** Messages sent per channel */
+	SpaceSaving<SLOTS> channelMessages;
+	/** Bytes sent to channel members, the message length times the number of recipients */
+	SpaceSaving<SLOTS> channelFanout;
+	/** Messages and notices sent per local user, keyed by UUID */
+	SpaceSaving<SLOTS> userMessages;
+
+	void reset()
+	{
+		channelMessages.reset();
+		channelFanout.reset();
+		userMessages.reset();
+	}
+};
+
+/* Values every server reports to the aggregating server, see NetworkAggregator */
+static const char *const summary_gauges[] = {"users", "sockets", "rate_in", "rate_out", "commands", "stalls"};
+static const char *const summary_histograms[] = {"loop", "iteration"};
+static const unsigned int SUMMARY_GAUGES = sizeof(summary_gauges) / sizeof(summary_gauges[0]);
+static const unsigned int SUMMARY_HISTOGRAMS = sizeof(summary_histograms) / sizeof(summary_histograms[0]);
+
+/** One server's metrics, as seen by the aggregating server */
+struct ServerSummary
+{
+	time_t lastSeen;
+	unsigned long long gauges[SUMMARY_GAUGES];
+	LatencyHistogram histograms[SUMMARY_HISTOGRAMS];
+
+	ServerSummary() : lastSeen(0)
+	{
+		memset(gauges, 0, sizeof(gauges));
+	}
+
+	void reset()
+	{
+		for (unsigned int i = 0; i < SUMMARY_HISTOGRAMS; ++i)
+			histograms[i].reset();
+	}
+};
+
+/** Merges the summaries servers send to the aggregating server each flush.
+ *
+ * A summary is a list of space separated tokens, short enough to send over a server link:
+ *   <gauge>=<value>                  latest value of a gauge, e.g. users=1234
+ *   <hist>.t=<count>/<total>/<max>   totals of a histogram
+ *   <hist>.b=<idx>:<n>,<idx>:<n>...  non-empty buckets, each index relative to the one before
+ * Histograms only ever add up, so a summary can be split over several messages between any two
+ * tokens and the buckets of a histogram can be split over several tokens.
+ */
+class NetworkAggregator
+{
+	typedef std::map<std::string, ServerSummary *> SummaryMap;
+	SummaryMap servers;
+
+	static int findName(const char *const *names, unsigned int count, const std::string &name)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			if (name == names[i])
+				return i;
+		}
+		return -1;
+	}
+
+	static void append(std::vector<std::string> &messages, const std::string &token, std::string::size_type maxlen)
+	{
+		if (messages.empty() || messages.back().size() + token.size() + 1 > maxlen)
+			messages.push_back(token);
+		else
+			messages.back().append(" ").append(token);
+	}
+
+	static void applyHistogram(LatencyHistogram &hist, const std::string &kind, const std::string &value)
+	{
+		if (kind == "t")
+		{
+			unsigned long n;
+			unsigned long long sum;
+			unsigned long largest;
+			if (sscanf(value.c_str(), "%lu/%llu/%lu", &n, &sum, &largest) == 3)
+				hist.mergeTotals(n, sum, largest);
+			return;
+		}
+
+		irc::commasepstream buckets(value);
+		std::string bucket;
+		unsigned long idx = 0;
+		while (buckets.GetToken(bucket))
+		{
+			unsigned long delta, n;
+			if (sscanf(bucket.c_str(), "%lu:%lu", &delta, &n) != 2)
+				return;
+			idx += delta;
+			hist.mergeBucket(idx, n);
+		}
+	}
+
+ public:
+	~NetworkAggregator()
+	{
+		for (SummaryMap::iterator i = servers.begin(); i != servers.end(); ++i)
+			delete i->second;
+	}
+
+	/** Encodes a summary into messages of at most maxlen bytes */
+	static void encode(const unsigned long long *gauges, const LatencyHistogram *const *histograms,
+					   std::vector<std::string> &messages, std::string::size_type maxlen)
+	{
+		for (unsigned int i = 0; i < SUMMARY_GAUGES; ++i)
+			append(messages, std::string(summary_gauges[i]) + "=" + ConvToStr(gauges[i]), maxlen);
+
+		for (unsigned int i = 0; i < SUMMARY_HISTOGRAMS; ++i)
+		{
+			const LatencyHistogram &hist = *histograms[i];
+			if (!hist.getCount())
+				continue;
+
+			std::string prefix = summary_histograms[i];
+			append(messages, prefix + ".t=" + ConvToStr(hist.getCount()) + "/" + ConvToStr(hist.getTotal()) + "/" +
+							 ConvToStr(hist.getMax()), maxlen);
+
+			std::string token;
+			unsigned int last = 0;
+			for (unsigned int idx = 0; idx < LatencyHistogram::BUCKETS; ++idx)
+			{
+				if (!hist.getBucket(idx))
+					continue;
+				if (token.size() > maxlen / 2)
+				{
+					append(messages, token, maxlen);
+					token.clear();
+					last = 0;
+				}
+				token.append(token.empty() ? prefix + ".b=" : ",");
+				token.append(ConvToStr(idx - last)).append(":").append(ConvToStr(hist.getBucket(idx)));
+				last = idx;
+			}
+			if (!token.empty())
+				append(messages, token, maxlen);
+		}
+	}
+
+	/** Merges one message of a server's summary */
+	void apply(const std::string &server, const std::string &summary, time_t now)
+	{
+		ServerSummary *&entry = servers[server];
+		if (!entry)
+			entry = new ServerSummary;
+		entry->lastSeen = now;
+
+		irc::spacesepstream tokens(summary);
+		std::string token;
+		while (tokens.GetToken(token))
+		{
+			std::string::size_type eq = token.find('=');
+			if (eq == std::string::npos)
+				continue;
+			std::string name(token, 0, eq);
+			std::string value(token, eq + 1);
+			std::string::size_type dot = name.find('.');
+			if (dot == std::string::npos)
+			{
+				int gauge = findName(summary_gauges, SUMMARY_GAUGES, name);
+				if (gauge >= 0)
+					entry->gauges[gauge] = strtoull(value.c_str(), NULL, 10);
+				continue;
+			}
+
+			// Unknown names are skipped, so newer servers can report more than we know of
+			int hist = findName(summary_histograms, SUMMARY_HISTOGRAMS, name.substr(0, dot));
+			if (hist >= 0)
+				applyHistogram(entry->histograms[hist], name.substr(dot + 1), value);
+		}
+	}
+
+	/** Forgets servers that have not sent a summary in maxAge seconds, e.g. after a split */
+	void expire(time_t now, time_t maxAge)
+	{
+		SummaryMap::iterator i = servers.begin();
+		while (i != servers.end())
+		{
+			if (now - i->second->lastSeen > maxAge)
+			{
+				delete i->second;
+				servers.erase(i++);
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+
+	/** Starts a new interval; gauges keep their last values */
+	void reset()
+	{
+		for (SummaryMap::iterator i = servers.begin(); i != servers.end(); ++i)
+			i->second->reset();
+	}
+
+	const SummaryMap &get() const
+	{
+		return servers;
+	}
+};
+
+/** Returns the longest wait before the given reconnect attempt, doubling per attempt up to a cap */
+static long reconnectDelay(long base, long cap, unsigned int attempts)
+{
+	long delay = base;
+	for (unsigned int i = 0; i < attempts && delay < cap; ++i)
+		delay *= 2;
+	return std::min(delay, cap);
+}
+
+/** Parses a plain decimal number, rejecting anything else */
+static bool parseNumber(const std::string &str, unsigned long &out)
+{
+	if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+	out = strtoul(str.c_str(), NULL, 10);
+	return true;
+}
+
+/** Parses an interval in seconds, or in milliseconds with an "ms" suffix, and returns it in milliseconds */
+static unsigned long parseInterval(const std::string &str, unsigned long def)
+{
+	unsigned long value;
+	if (str.size() > 2 && !str.compare(str.size() - 2, 2, "ms"))
+		return parseNumber(str.substr(0, str.size() - 2), value) ? value : def;
+	return parseNumber(str, value) ? value * 1000 : def;
+}
+
+/** Decides which collectors run on each flush.
+ *
+ * Every collector runs once every so many flushes. Those that don't run on every flush get
+ * different offsets where their periods allow, so the expensive ones are spread over separate
+ * flushes instead of all landing on the same one.
+ */
+class CollectorSchedule
+{
+ public:
+	enum Collector
+	{
+		LOOP,
+		COMMANDS,
+		HOOKS,
+		WHOWAS,
+		PROCESS,
+		COUNT
+	};
+
+	static const unsigned int ALL = (1 << COUNT) - 1;
+
+ private:
+	unsigned int period[COUNT];
+	unsigned int phase[COUNT];
+	unsigned long flushes;
+
+ public:
+	CollectorSchedule() : flushes(0)
+	{
+		for (unsigned int i = 0; i < COUNT; ++i)
+			period[i] = 1, phase[i] = 0;
+	}
+
+	static const char *name(unsigned int collector)
+	{
+		static const char *const names[COUNT] = {"loop", "commands", "hooks", "whowas", "process"};
+		return names[collector];
+	}
+
+	/** Sets how many flushes apart each collector runs */
+	void configure(const unsigned int periods[COUNT])
+	{
+		unsigned int offset = 0;
+		for (unsigned int i = 0; i < COUNT; ++i)
+		{
+			period[i] = std::max(periods[i], 1U);
+			phase[i] = period[i] > 1 ? offset++ % period[i] : 0;
+		}
+		flushes = 0;
+	}
+
+	/** Returns the collectors that run on this flush, as bits of (1 << Collector), and moves on to the next */
+	unsigned int next()
+	{
+		unsigned int due = 0;
+		for (unsigned int i = 0; i < COUNT; ++i)
+		{
+			if (flushes % period[i] == phase[i])
+				due |= 1 << i;
+		}
+		flushes++;
+		return due;
+	}
+
+	unsigned int getPeriod(unsigned int collector) const
+	{
+		return period[collector];
+	}
+
+	unsigned int longest() const
+	{
+		return *std::max_element(period, period + COUNT);
+	}
+};
+
+/** Burst and socket details of server links, pieced together from what the protocol module reports.
+ *
+ * 2.0's spanningtree does not expose its sockets, so bursts are followed through the link
+ * snotices it sends and the sync hooks it calls in between. The socket a burst is written to
+ * is kept so its sendq can be read later, and only used while the socket engine still has it.
+ */
+class LinkTracker
+{
+ public:
+	struct Link
+	{
+		EventHandler *socket;
+		int fd;
+		unsigned long long burstStart;
+		/* The last burst we sent */
+		unsigned long long burstTime;
+		unsigned long burstUsers;
+		unsigned long burstChannels;
+		size_t burstBytes;
+		/* The last burst we received, in milliseconds as measured by spanningtree */
+		unsigned long receivedBurstTime;
+
+		Link()
+			: socket(NULL), fd(-1), burstStart(0), burstTime(0), burstUsers(0), burstChannels(0), burstBytes(0),
+			  receivedBurstTime(0)
+		{
+		}
+	};
+
+	typedef std::map<std::string, Link> LinkMap;
+
+ private:
+	LinkMap links;
+	std::string bursting;
+
+	/** Splits a snotice of the form "<prefix>\2<name>\2<rest>", returning false if it isn't one */
+	static bool serverName(const std::string &message, const std::string &prefix, std::string &name, std::string &rest)
+	{
+		if (message.compare(0, prefix.size(), prefix) || message.size() <= prefix.size()
+			|| message[prefix.size()] != '\2')
+			return false;
+		std::string::size_type end = message.find('\2', prefix.size() + 1);
+		if (end == std::string::npos || end == prefix.size() + 1)
+			return false;
+		name = message.substr(prefix.size() + 1, end - prefix.size() - 1);
+		rest = message.substr(end + 1);
+		return true;
+	}
+
+	/** Reads the burst time from the end of "Received end of netburst" in milliseconds */
+	static bool burstTime(const std::string &rest, unsigned long &ms)
+	{
+		// " (burst time: <n> msecs)", or "secs)" for long ones
+		static const std::string prefix = " (burst time: ";
+		if (rest.compare(0, prefix.size(), prefix))
+			return false;
+		irc::spacesepstream stream(rest.substr(prefix.size()));
+		std::string amount;
+		std::string unit;
+		if (!stream.GetToken(amount) || !stream.GetToken(unit) || !stream.StreamEnd() || !parseNumber(amount, ms))
+			return false;
+		if (unit == "secs)")
+			ms *= 1000;
+		else if (unit != "msecs)")
+			return false;
+		return true;
+	}
+
+ public:
+	/** Follows bursts through spanningtree's link snotices. Only the exact forms spanningtree sends
+	 * are understood, anything else, e.g. after their wording changed, is left alone.
+	 */
+	void snotice(const std::string &message, unsigned long long now)
+	{
+		std::string name;
+		std::string rest;
+		unsigned long ms;
+		if (serverName(message, "Bursting to ", name, rest) && !rest.compare(0, 18, " (Authentication: "))
+		{
+			Link &link = links[name];
+			link.socket = NULL;
+			link.fd = -1;
+			link.burstStart = now;
+			link.burstUsers = link.burstChannels = 0;
+			bursting = name;
+		}
+		else if (serverName(message, "Finished bursting to ", name, rest) && rest == ".")
+		{
+			if (name != bursting)
+				return;
+			Link &link = links[name];
+			link.burstTime = now - link.burstStart;
+			// The whole burst is queued before anything is written out
+			link.burstBytes = sendq(link);
+			bursting.clear();
+		}
+		else if (serverName(message, "Received end of netburst from ", name, rest) && burstTime(rest, ms))
+		{
+			links[name].receivedBurstTime = ms;
+		}
+	}
+
+	void syncNetwork(EventHandler *socket)
+	{
+		if (bursting.empty())
+			return;
+		Link &link = links[bursting];
+		link.socket = socket;
+		link.fd = socket->GetFd();
+	}
+
+	void syncUser()
+	{
+		if (!bursting.empty())
+			links[bursting].burstUsers++;
+	}
+
+	void syncChannel()
+	{
+		if (!bursting.empty())
+			links[bursting].burstChannels++;
+	}
+
+	/** Returns the number of bytes queued on the link, or 0 if its socket is gone */
+	size_t sendq(const Link &link) const
+	{
+		if (!link.socket || link.fd < 0 || ServerInstance->SE->GetRef(link.fd) != link.socket)
+			return 0;
+		return static_cast<StreamSocket *>(link.socket)->getSendQSize();
+	}
+
+	/** Forgets servers that are no longer linked */
+	void expire(const ProtoServerList &servers)
+	{
+		std::set<std::string> linked;
+		for (ProtoServerList::const_iterator i = servers.begin(); i != servers.end(); ++i)
+			linked.insert(i->servername);
+		for (LinkMap::iterator i = links.begin(); i != links.end();)
+		{
+			if (linked.count(i->first) || i->first == bursting)
+				++i;
+			else
+				links.erase(i++);
+		}
+	}
+
+	const Link *find(const std::string &name) const
+	{
+		LinkMap::const_iterator i = links.find(name);
+		return i == links.end() ? NULL : &i->second;
+	}
+};
+
+/** A source of metrics that is costly to gather, so its values are kept between refreshes.
+ *
+ * They are refreshed when the CollectorSchedule says so, and their last values are reported on
+ * every flush in between.
+ */
+class CachedCollector
+{
+ protected:
+	/** Gathers fresh values, returns false if there are none to report */
+	virtual bool Collect() = 0;
+
+ public:
+	bool valid;
+
+	/** Whether the next flush should refresh regardless of the schedule, e.g. after the config changed */
+	bool stale;
+
+	CachedCollector() : valid(false), stale(true)
+	{
+	}
+
+	virtual ~CachedCollector()
+	{
+	}
+
+	void Refresh()
+	{
+		stale = false;
+		valid = Collect();
+	}
+};
+
+/** Number of whowas entries and the memory they use.
+ *
+ * cmd_whowas only hands these out as a sentence, and walks the whole whowas table to build it.
+ */
+class WhowasCollector : public CachedCollector
+{
+	/** Parses "Whowas entries: <entries> (<bytes> bytes)" */
+	bool Parse(const std::string &stats)
+	{
+		irc::spacesepstream tokens(stats);
+		std::string word, count, size;
+		if (!tokens.GetToken(word) || word != "Whowas" || !tokens.GetToken(word) || word != "entries:")
+			return false;
+		if (!tokens.GetToken(count) || !tokens.GetToken(size) || size.size() < 2 || size[0] != '(')
+			return false;
+		return parseNumber(count, entries) && parseNumber(size.substr(1), bytes);
+	}
+
+ protected:
+	bool Collect()
+	{
+		if (!ServerInstance->Config->WhoWasGroupSize || !ServerInstance->Config->WhoWasMaxGroups)
+			return false;
+		Module *whowas = ServerInstance->Modules->Find("cmd_whowas.so");
+		if (!whowas)
+			return false;
+
+		WhowasRequest req(NULL, whowas, WhowasRequest::WHOWAS_STATS);
+		req.user = ServerInstance->FakeClient;
+		req.Send();
+		if (Parse(req.value))
+			return true;
+		ServerInstance->Logs->Log("TELEGRAF", DEBUG, "Unexpected whowas stats: %s", req.value.c_str());
+		return false;
+	}
+
+ public:
+	unsigned long entries;
+	unsigned long bytes;
+
+	WhowasCollector() : entries(0), bytes(0)
+	{
+	}
+};
+
+/** Resource usage of the ircd process itself: CPU, context switches, faults, memory and heap */
+class ProcessCollector : public CachedCollector
+{
+	static unsigned long long timevalMicros(const timeval &tv)
+	{
+		return tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+
+	/** Reads the memory figures from /proc/self/status, where there is one */
+	bool ReadStatus()
+	{
+		FILE *status = fopen("/proc/self/status", "r");
+		if (!status)
+			return false;
+
+		char line[256];
+		unsigned long kb;
+		while (fgets(line, sizeof(line), status))
+		{
+			if (sscanf(line, "VmRSS: %lu kB", &kb) == 1)
+				rss = kb * 1024ULL;
+			else if (sscanf(line, "VmHWM: %lu kB", &kb) == 1)
+				rssPeak = kb * 1024ULL;
+			else if (sscanf(line, "VmSize: %lu kB", &kb) == 1)
+				virtualSize = kb * 1024ULL;
+		}
+		fclose(status);
+		return true;
+	}
+
+	void ReadHeap()
+	{
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+		struct mallinfo2 info = mallinfo2();
+#elif defined __GLIBC__
+		// The fields of the old mallinfo are ints and wrap past 2GB
+		struct mallinfo info = mallinfo();
+#endif
+#ifdef __GLIBC__
+		heapArena = info.arena;
+		heapMapped = info.hblkhd;
+		heapInUse = info.uordblks;
+		heapFree = info.fordblks;
+		heapReleasable = info.keepcost;
+		hasHeap = true;
+#endif
+	}
+
+ protected:
+	bool Collect()
+	{
+		rusage ru;
+		if (getrusage(RUSAGE_SELF, &ru))
+			return false;
+
+		cpuUser = timevalMicros(ru.ru_utime);
+		cpuSystem = timevalMicros(ru.ru_stime);
+		contextVoluntary = ru.ru_nvcsw;
+		contextInvoluntary = ru.ru_nivcsw;
+		faultsMajor = ru.ru_majflt;
+		faultsMinor = ru.ru_minflt;
+		hasStatus = ReadStatus();
+		if (!hasStatus)
+		{
+			// Without /proc the peak is all there is, in kB everywhere but macOS
+#ifdef __APPLE__
+			rssPeak = ru.ru_maxrss;
+#else
+			rssPeak = ru.ru_maxrss * 1024ULL;
+#endif
+		}
+		ReadHeap();
+		return true;
+	}
+
+ public:
+	unsigned long long cpuUser;
+	unsigned long long cpuSystem;
+	unsigned long long contextVoluntary;
+	unsigned long long contextInvoluntary;
+	unsigned long long faultsMajor;
+	unsigned long long faultsMinor;
+	bool hasStatus;
+	unsigned long long rss;
+	unsigned long long rssPeak;
+	unsigned long long virtualSize;
+	bool hasHeap;
+	unsigned long long heapArena;
+	unsigned long long heapMapped;
+	unsigned long long heapInUse;
+	unsigned long long heapFree;
+	unsigned long long heapReleasable;
+
+	ProcessCollector()
+			: cpuUser(0), cpuSystem(0), contextVoluntary(0), contextInvoluntary(0),
+			  faultsMajor(0), faultsMinor(0), hasStatus(false), rss(0), rssPeak(0), virtualSize(0), hasHeap(false),
+			  heapArena(0), heapMapped(0), heapInUse(0), heapFree(0), heapReleasable(0)
+	{
+	}
+};
+
+class HookProbe;
+
+/** Wall time and invocation counts per module per profiled event.
+ *
+ * When installed, a HookProbe is placed before the first module and after every module in the
+ * handler list of each profiled event. Each probe charges the time since the previous probe ran
+ * to the module in front of it.
+ *
+ * A module that stops the event early by returning a result, e.g. one denying a message, never
+ * reaches the probe after it. Its call is left open and charged up to the next probe of any event
+ * or the end of the iteration, whichever comes first. Probes that run inside the module's own call
+ * close it early, so such a call may be undercounted but is never lost.
+ *
+ * The probes are spliced into the core's handler lists, which modules being loaded or unloaded
+ * reorder. Until the probes are laid out again the profiler is suspended rather than charging
+ * the wrong modules.
+ */
+class HookProfiler
+{
+ public:
+	static const unsigned int MAX_MODULES = 128;
+	static const unsigned int NO_MODULE = MAX_MODULES;
+
+	struct Entry
+	{
+		unsigned long count;
+		unsigned long long total;
+		unsigned long long max;
+	};
+
+ private:
+	NameIndex<MAX_MODULES> modules;
+	Entry entries[MAX_MODULES][PROFILED_EVENT_COUNT];
+	unsigned long long lastMark[PROFILED_EVENT_COUNT];
+	/* The module each event has been in since its last mark, or NO_MODULE */
+	unsigned int open[PROFILED_EVENT_COUNT];
+	/* When the first probe of another event ran after the last mark, or 0 */
+	unsigned long long closedAt[PROFILED_EVENT_COUNT];
+	/* The event that marked last, if it is still in a module */
+	unsigned int lastOpen;
+	bool closeQueued;
+	bool suspended;
+	std::vector<HookProbe *> probes;
+
+	HookProbe *getProbe(unsigned int pos, unsigned int event, unsigned int module, unsigned int next);
+
+	void charge(unsigned int event, unsigned int module, unsigned long long elapsed)
+	{
+		Entry &entry = entries[module][event];
+		entry.count++;
+		entry.total += elapsed;
+		if (elapsed > entry.max)
+			entry.max = elapsed;
+		if (stalls && stalls->threshold)
+			stalls->check("hook", elapsed, modules.name(module), profiled_event_names[event]);
+	}
+
+	void clearOpen()
+	{
+		memset(lastMark, 0, sizeof(lastMark));
+		memset(closedAt, 0, sizeof(closedAt));
+		for (unsigned int event = 0; event < PROFILED_EVENT_COUNT; ++event)
+			open[event] = NO_MODULE;
+		lastOpen = PROFILED_EVENT_COUNT;
+	}
+
+ public:
+	StallLog *stalls;
+
+	/* Queued at most once per iteration while a call is open, see closeOpen(), unless owner is unloading */
+	HandlerBase0<void> *closer;
+	Module *owner;
+
+	HookProfiler() : closeQueued(false), suspended(false), stalls(NULL), closer(NULL), owner(NULL)
+	{
+		reset();
+		clearOpen();
+	}
+
+	~HookProfiler();
+
+	/** Called by the probe placed after module, in front of next */
+	void mark(unsigned int event, unsigned int module, unsigned int next)
+	{
+		if (suspended)
+			return;
+
+		unsigned long long now = monotonicMicros();
+		// Whatever module the last event was in has returned by now, unless this runs inside it
+		if (lastOpen != PROFILED_EVENT_COUNT && !closedAt[lastOpen])
+			closedAt[lastOpen] = now;
+
+		if (lastMark[event])
+		{
+			if (module != NO_MODULE)
+				charge(event, module, now - lastMark[event]);
+			else if (open[event] != NO_MODULE)
+				// The previous dispatch of this event was stopped by the module it was in
+				charge(event, open[event], closedAt[event] - lastMark[event]);
+		}
+
+		lastMark[event] = now;
+		open[event] = next;
+		closedAt[event] = 0;
+		lastOpen = (next == NO_MODULE) ? PROFILED_EVENT_COUNT : event;
+		if (next != NO_MODULE && !closeQueued && closer && !owner->dying)
+		{
+			closeQueued = true;
+			ServerInstance->AtomicActions.AddAction(closer);
+		}
+	}
+
+	/** Charges the calls that stopped their events early, at the end of an iteration */
+	void closeOpen()
+	{
+		closeQueued = false;
+		if (suspended)
+			return;
+
+		unsigned long long now = monotonicMicros();
+		for (unsigned int event = 0; event < PROFILED_EVENT_COUNT; ++event)
+		{
+			if (open[event] == NO_MODULE || !lastMark[event])
+				continue;
+			charge(event, open[event], (closedAt[event] ? closedAt[event] : now) - lastMark[event]);
+			open[event] = NO_MODULE;
+		}
+		lastOpen = PROFILED_EVENT_COUNT;
+	}
+
+	/** Stops charging anything until the probes are laid out again, see TelegrafModule::ScheduleHookLayout */
+	void suspend()
+	{
+		suspended = true;
+		clearOpen();
+	}
+
+	void reset()
+	{
+		memset(entries, 0, sizeof(entries));
+	}
+
+	/** Places probes around every module attached to the profiled events */
+	void install();
+
+	/** Takes all probes out of the event handler lists */
+	void remove();
+
+	const std::string &name(unsigned int module) const
+	{
+		return modules.name(module);
+	}
+
+	const Entry &get(unsigned int module, unsigned int event) const
+	{
+		return entries[module][event];
+	}
+};
+
+/** A stand-in module that only marks the time it was called at, see HookProfiler */
+class HookProbe : public Module
+{
+	HookProfiler *profiler;
+
+ public:
+	unsigned int event;
+	unsigned int module;
+
+	/* The module after this probe in the handler list */
+	unsigned int next;
+
+	HookProbe(HookProfiler *p) : profiler(p), event(0), module(HookProfiler::NO_MODULE), next(HookProfiler::NO_MODULE)
+	{
+	}
+
+	void mark()
+	{
+		profiler->mark(event, module, next);
+	}
+
+	ModResult OnUserPreMessage(User *, void *, int, std::string &, char, CUList &)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnUserPreNotice(User *, void *, int, std::string &, char, CUList &)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUserMessage(User *, void *, int, const std::string &, char, const CUList &)
+	{
+		mark();
+	}
+
+	void OnUserNotice(User *, void *, int, const std::string &, char, const CUList &)
+	{
+		mark();
+	}
+
+	ModResult OnPreCommand(std::string &, std::vector<std::string> &, LocalUser *, bool, const std::string &)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnPostCommand(const std::string &, const std::vector<std::string> &, LocalUser *, CmdResult,
+					   const std::string &)
+	{
+		mark();
+	}
+
+	ModResult OnUserPreJoin(User *, Channel *, const char *, std::string &, const std::string &)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUserJoin(Membership *, bool, bool, CUList &)
+	{
+		mark();
+	}
+
+	void OnUserPart(Membership *, std::string &, CUList &)
+	{
+		mark();
+	}
+
+	void OnUserQuit(User *, const std::string &, const std::string &)
+	{
+		mark();
+	}
+
+	ModResult OnUserPreNick(User *, const std::string &)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnCheckBan(User *, Channel *, const std::string &)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnRawMode(User *, Channel *, const char, const std::string &, bool, int)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUserConnect(LocalUser *)
+	{
+		mark();
+	}
+
+	ModResult OnCheckReady(LocalUser *)
+	{
+		mark();
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnBackgroundTimer(time_t)
+	{
+		mark();
+	}
+
+	Version GetVersion()
+	{
+		return Version("Hook profiler probe for m_telegraf");
+	}
+};
+
+static bool isHookProbe(Module *mod)
+{
+	return dynamic_cast<HookProbe *>(mod) != NULL;
+}
+
+HookProfiler::~HookProfiler()
+{
+	remove();
+	for (std::vector<HookProbe *>::iterator i = probes.begin(); i != probes.end(); ++i)
+		delete *i;
+}
+
+HookProbe *HookProfiler::getProbe(unsigned int pos, unsigned int event, unsigned int module, unsigned int next)
+{
+	if (pos == probes.size())
+		probes.push_back(new HookProbe(this));
+	HookProbe *probe = probes[pos];
+	probe->event = event;
+	probe->module = module;
+	probe->next = next;
+	return probe;
+}
+
+void HookProfiler::install()
+{
+	remove();
+	unsigned int pos = 0;
+	for (unsigned int event = 0; event < PROFILED_EVENT_COUNT; ++event)
+	{
+		IntModuleList &handlers = ServerInstance->Modules->EventHandlers[profiled_events[event]];
+		IntModuleList layout;
+		layout.reserve(handlers.size() * 2 + 1);
+		unsigned int module = NO_MODULE;
+		for (EventHandlerIter i = handlers.begin(); i != handlers.end(); ++i)
+		{
+			unsigned int next = modules.find((*i)->ModuleSourceFile);
+			layout.push_back(getProbe(pos++, event, module, next));
+			layout.push_back(*i);
+			module = next;
+		}
+		layout.push_back(getProbe(pos++, event, module, NO_MODULE));
+		handlers.swap(layout);
+	}
+	clearOpen();
+	suspended = false;
+}
+
+void HookProfiler::remove()
+{
+	for (unsigned int event = 0; event < PROFILED_EVENT_COUNT; ++event)
+	{
+		IntModuleList &handlers = ServerInstance->Modules->EventHandlers[profiled_events[event]];
+		handlers.erase(std::remove_if(handlers.begin(), handlers.end(), isHookProbe), handlers.end());
+	}
+}
+
+/** Receives metrics one measurement at a time, see TelegrafModule::GetMetrics.
+ *
+ * A measurement is written with begin(), any number of tag() calls, the fields, then end().
+ */
+class MetricsWriter
+{
+ public:
+	virtual ~MetricsWriter()
+	{
+	}
+
+	virtual void begin(const char *measurement) = 0;
+
+	/** Starts a measurement that records a single event rather than a time series, which happened
+	 * at ns nanoseconds since the epoch
+	 */
+	virtual void beginEvent(const char *measurement, unsigned long long ns) = 0;
+
+	virtual void tag(const char *key, const std::string &value) = 0;
+
+	/** Writes a typed integer field */
+	virtual void intField(const char *key, long long value) = 0;
+
+	/** Writes a whole number without the integer suffix, which InfluxDB stores as a float.
+	 * Used for the fields of the ircd measurement, which have always been floats.
+	 */
+	virtual void numberField(const char *key, unsigned long long value) = 0;
+
+	virtual void floatField(const char *key, double value) = 0;
+
+	virtual void boolField(const char *key, bool value) = 0;
+
+	virtual void stringField(const char *key, const std::string &value) = 0;
+
+	virtual void end() = 0;
+};
+
+/** Writes InfluxDB line protocol straight into one reusable buffer.
+ *
+ * A line is written with begin(), any number of tag() calls, the fields, then end(). Lines
+ * without fields are dropped as InfluxDB would reject them. Measurement names and keys are
+ * expected to be plain identifiers and are written unescaped. If a timestamp is set, it is
+ * appended to every line so that spooled lines keep the time they were collected at. Events
+ * carry the time they happened at instead.
+ */
+class LineEncoder : public MetricsWriter
+{
+	std::string buffer;
+	std::string::size_type lineStart;
+	bool firstField;
+	std::string timestamp;
+	std::string eventTimestamp;
+	bool event;
+
+	void appendEscaped(const std::string &in, const char *special)
+	{
+		// Nearly every value we write is a plain name or number, so check once before escaping
+		if (in.find_first_of(special) == std::string::npos)
+		{
+			buffer.append(in);
+			return;
+		}
+		for (std::string::const_iterator i = in.begin(); i != in.end(); ++i)
+		{
+			if (*i && strchr(special, *i))
+				buffer.push_back('\\');
+			buffer.push_back(*i);
+		}
+	}
+
+	static void appendNumber(std::string &out, unsigned long long value)
+	{
+		char digits[20];
+		char *p = digits + sizeof(digits);
+		do
+		{
+			*--p = '0' + value % 10;
+			value /= 10;
+		} while (value);
+		out.append(p, digits + sizeof(digits) - p);
+	}
+
+	void appendKey(const char *key)
+	{
+		buffer.push_back(firstField ? ' ' : ',');
+		firstField = false;
+		buffer.append(key);
+		buffer.push_back('=');
+	}
+
+ public:
+	LineEncoder() : lineStart(0), firstField(true), event(false)
+	{
+		buffer.reserve(4096);
+	}
+
+	/** Empties the buffer but keeps its memory for the next flush */
+	void clear()
+	{
+		buffer.clear();
+	}
+
+	/** Sets the timestamp, in nanoseconds since the epoch, written on the lines that follow */
+	void setTimestamp(unsigned long long ns)
+	{
+		timestamp.assign(1, ' ');
+		appendNumber(timestamp, ns);
+	}
+
+	void begin(const char *measurement)
+	{
+		lineStart = buffer.size();
+		firstField = true;
+		event = false;
+		buffer.append(measurement);
+	}
+
+	void beginEvent(const char *measurement, unsigned long long ns)
+	{
+		begin(measurement);
+		eventTimestamp.assign(1, ' ');
+		appendNumber(eventTimestamp, ns);
+		event = true;
+	}
+
+	void tag(const char *key, const std::string &value)
+	{
+		buffer.push_back(',');
+		buffer.append(key);
+		buffer.push_back('=');
+		appendEscaped(value, ", =\\");
+	}
+
+	void intField(const char *key, long long value)
+	{
+		appendKey(key);
+		if (value < 0)
+		{
+			buffer.push_back('-');
+			appendNumber(buffer, -static_cast<unsigned long long>(value));
+		}
+		else
+		{
+			appendNumber(buffer, value);
+		}
+		buffer.push_back('i');
+	}
+
+	void numberField(const char *key, unsigned long long value)
+	{
+		appendKey(key);
+		appendNumber(buffer, value);
+	}
+
+	void floatField(const char *key, double value)
+	{
+		appendKey(key);
+		if (value != value)
+			value = 0;
+		char digits[32];
+		int len = snprintf(digits, sizeof(digits), "%.15g", value);
+		buffer.append(digits, len);
+	}
+
+	void boolField(const char *key, bool value)
+	{
+		appendKey(key);
+		buffer.append(value ? "true" : "false");
+	}
+
+	void stringField(const char *key, const std::string &value)
+	{
+		appendKey(key);
+		buffer.push_back('"');
+		appendEscaped(value, "\"\\");
+		buffer.push_back('"');
+	}
+
+	void end()
+	{
+		if (firstField)
+		{
+			buffer.erase(lineStart);
+			return;
+		}
+		buffer.append(event ? eventTimestamp : timestamp);
+		buffer.push_back('\n');
+	}
+
+	const std::string &str() const
+	{
+		return buffer;
+	}
+};
+
+/** Writes metrics in the Prometheus text exposition format.
+ *
+ * Every field becomes a sample named <measurement>_<field>, labelled with the measurement's tags.
+ * Prometheus wants all samples of a metric together, so samples are collected per metric and
+ * only put in order by render(). String fields have no Prometheus equivalent and are skipped, as
+ * are event measurements, which would show up as samples with clashing labels.
+ */
+class PrometheusEncoder : public MetricsWriter
+{
+	struct Family
+	{
+		std::string name;
+		std::string samples;
+		/* The flush the samples are from */
+		unsigned long flush;
+	};
+
+	/* Families are kept across flushes so their buffers are reused */
+	std::vector<Family> families;
+	unsigned long flushes;
+	unsigned long retention;
+	std::map<std::string, unsigned int> index;
+	std::string measurement;
+	std::string labels;
+	std::string metric;
+	bool skipping;
+
+	std::string &samplesFor(const char *key)
+	{
+		metric.assign(measurement);
+		metric.push_back('_');
+		metric.append(key);
+		std::map<std::string, unsigned int>::iterator it = index.find(metric);
+		if (it == index.end())
+		{
+			it = index.insert(std::make_pair(metric, families.size())).first;
+			families.push_back(Family());
+			families.back().name = metric;
+			families.back().flush = flushes;
+		}
+		Family &family = families[it->second];
+		if (family.flush != flushes)
+		{
+			// Replaces what an earlier flush had for this metric
+			family.samples.clear();
+			family.flush = flushes;
+		}
+		std::string &samples = family.samples;
+		samples.append(metric);
+		if (!labels.empty())
+		{
+			samples.push_back('{');
+			samples.append(labels);
+			samples.push_back('}');
+		}
+		samples.push_back(' ');
+		return samples;
+	}
+
+	void sample(const char *key, const char *value)
+	{
+		if (skipping)
+			return;
+		samplesFor(key).append(value).push_back('\n');
+	}
+
+ public:
+	PrometheusEncoder() : flushes(0), retention(1), skipping(false)
+	{
+	}
+
+	/** Starts a flush. Metrics written during it replace the ones from earlier flushes, the rest
+	 * are kept as they are, so collectors that don't run on every flush don't disappear in between.
+	 */
+	void startFlush()
+	{
+		flushes++;
+	}
+
+	/** Sets after how many flushes without new samples a metric is left out */
+	void setRetention(unsigned long count)
+	{
+		retention = std::max(count, 1UL);
+	}
+
+	void begin(const char *m)
+	{
+		measurement.assign(m);
+		labels.clear();
+		skipping = false;
+	}
+
+	void beginEvent(const char *m, unsigned long long ns)
+	{
+		skipping = true;
+	}
+
+	void tag(const char *key, const std::string &value)
+	{
+		if (skipping)
+			return;
+		if (!labels.empty())
+			labels.push_back(',');
+		labels.append(key);
+		labels.append("=\"");
+		for (std::string::const_iterator i = value.begin(); i != value.end(); ++i)
+		{
+			if (*i == '\\' || *i == '"')
+				labels.push_back('\\');
+			if (*i == '\n')
+				labels.append("\\n");
+			else
+				labels.push_back(*i);
+		}
+		labels.push_back('"');
+	}
+
+	void intField(const char *key, long long value)
+	{
+		char digits[24];
+		snprintf(digits, sizeof(digits), "%lld", value);
+		sample(key, digits);
+	}
+
+	void numberField(const char *key, unsigned long long value)
+	{
+		char digits[24];
+		snprintf(digits, sizeof(digits), "%llu", value);
+		sample(key, digits);
+	}
+
+	void floatField(const char *key, double value)
+	{
+		char digits[32];
+		if (value != value)
+			strcpy(digits, "NaN");
+		else
+			snprintf(digits, sizeof(digits), "%.15g", value);
+		sample(key, digits);
+	}
+
+	void boolField(const char *key, bool value)
+	{
+		sample(key, value ? "1" : "0");
+	}
+
+	void stringField(const char *key, const std::string &value)
+	{
+	}
+
+	void end()
+	{
+	}
+
+	/** Appends every metric that has samples to out */
+	void render(std::string &out) const
+	{
+		for (std::vector<Family>::const_iterator i = families.begin(); i != families.end(); ++i)
+		{
+			if (i->samples.empty() || flushes - i->flush >= retention)
+				continue;
+			out.append("# TYPE ").append(i->name).append(" untyped\n");
+			out.append(i->samples);
+		}
+	}
+};
+
+/** Hands every metric to two writers, so a flush is only gathered once */
+class MetricsTee : public MetricsWriter
+{
+	MetricsWriter &first;
+	MetricsWriter &second;
+
+ public:
+	MetricsTee(MetricsWriter &a, MetricsWriter &b) : first(a), second(b)
+	{
+	}
+
+	void begin(const char *measurement)
+	{
+		first.begin(measurement);
+		second.begin(measurement);
+	}
+
+	void beginEvent(const char *measurement, unsigned long long ns)
+	{
+		first.beginEvent(measurement, ns);
+		second.beginEvent(measurement, ns);
+	}
+
+	void tag(const char *key, const std::string &value)
+	{
+		first.tag(key, value);
+		second.tag(key, value);
+	}
+
+	void intField(const char *key, long long value)
+	{
+		first.intField(key, value);
+		second.intField(key, value);
+	}
+
+	void numberField(const char *key, unsigned long long value)
+	{
+		first.numberField(key, value);
+		second.numberField(key, value);
+	}
+
+	void floatField(const char *key, double value)
+	{
+		first.floatField(key, value);
+		second.floatField(key, value);
+	}
+
+	void boolField(const char *key, bool value)
+	{
+		first.boolField(key, value);
+		second.boolField(key, value);
+	}
+
+	void stringField(const char *key, const std::string &value)
+	{
+		first.stringField(key, value);
+		second.stringField(key, value);
+	}
+
+	void end()
+	{
+		first.end();
+		second.end();
+	}
+};
+
+/** Holds encoded flushes, oldest first, while Telegraf can't take them.
+ *
+ * Flushes are kept in memory up to a byte limit. Past that, the oldest data moves to an optional
+ * append-only spool file with its own size limit, and once that is full as well the oldest data
+ * is dropped. The file always holds older data than memory, so it is replayed first. A spool file
+ * left over from a previous run is picked up and replayed too.
+ */
+class MetricsSpool
+{
+	std::deque<std::string> memory;
+	std::string::size_type memoryBytes;
+	std::string::size_type maxMemory;
+	std::string path;
+	off_t maxFile;
+	off_t fileSize;
+	off_t fileRead;
+
+	/** Takes whole lines, at least one, up to max bytes from the front of a string */
+	static std::string::size_type lineCut(const std::string &data, std::string::size_type max)
+	{
+		if (max >= data.size())
+			return data.size();
+		std::string::size_type last = max ? data.rfind('\n', max - 1) : std::string::npos;
+		if (last == std::string::npos)
+			last = data.find('\n');
+		return last == std::string::npos ? data.size() : last + 1;
+	}
+
+	void toFile(const std::string &lines)
+	{
+		if (path.empty() || fileSize + static_cast<off_t>(lines.size()) > maxFile)
+		{
+			drop(lines);
+			return;
+		}
+
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+		if (fd < 0)
+		{
+			ServerInstance->Logs->Log("TELEGRAF", DEFAULT, "Can't open spool file %s: %s", path.c_str(),
+									  strerror(errno));
+			drop(lines);
+			return;
+		}
+		ssize_t written = write(fd, lines.data(), lines.size());
+		close(fd);
+		if (written != static_cast<ssize_t>(lines.size()))
+		{
+			// Don't leave a torn line behind for the replay to trip over
+			if (written > 0 && truncate(path.c_str(), fileSize) < 0)
+				fileSize += written;
+			drop(lines);
+			return;
+		}
+		fileSize += written;
+	}
+
+	bool fromFile(std::string &out, std::string::size_type max)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			fileSize = fileRead = 0;
+			return false;
+		}
+		out.resize(std::min<off_t>(max, fileSize - fileRead));
+		ssize_t got = pread(fd, &out[0], out.size(), fileRead);
+		close(fd);
+		if (got <= 0)
+		{
+			// Someone else truncated the file
+			out.clear();
+			fileSize = fileRead = 0;
+			return false;
+		}
+		out.resize(got);
+
+		std::string::size_type last = out.rfind('\n');
+		if (last == std::string::npos)
+		{
+			// A line longer than a whole replay chunk, there is no sensible way to send it
+			fileRead += got;
+			out.clear();
+			dropped++;
+		}
+		else
+		{
+			out.erase(last + 1);
+			fileRead += out.size();
+		}
+
+		if (fileRead >= fileSize)
+		{
+			// Fully replayed, start the file over
+			if (truncate(path.c_str(), 0) < 0)
+				unlink(path.c_str());
+			fileSize = fileRead = 0;
+		}
+		return !out.empty();
+	}
+
+	void drop(const std::string &lines)
+	{
+		dropped += std::count(lines.begin(), lines.end(), '\n');
+	}
+
+ public:
+	/** Number of lines thrown away because the spool was full */
+	unsigned long dropped;
+
+	MetricsSpool() : memoryBytes(0), maxMemory(0), maxFile(0), fileSize(0), fileRead(0), dropped(0)
+	{
+	}
+
+	void configure(std::string::size_type memoryLimit, const std::string &file, off_t fileLimit)
+	{
+		maxMemory = memoryLimit;
+		maxFile = fileLimit;
+		if (file == path)
+			return;
+
+		path = file;
+		fileSize = fileRead = 0;
+		struct stat st;
+		if (!path.empty() && stat(path.c_str(), &st) == 0)
+			fileSize = st.st_size;
+	}
+
+	bool enabled() const
+	{
+		return maxMemory > 0 || !path.empty();
+	}
+
+	bool empty() const
+	{
+		return memory.empty() && fileRead >= fileSize;
+	}
+
+	/** Returns the number of bytes waiting to be replayed */
+	unsigned long long size() const
+	{
+		return memoryBytes + (fileSize - fileRead);
+	}
+
+	void push(const std::string &lines)
+	{
+		memory.push_back(lines);
+		memoryBytes += lines.size();
+		while (memoryBytes > maxMemory && !memory.empty())
+		{
+			toFile(memory.front());
+			memoryBytes -= memory.front().size();
+			memory.pop_front();
+		}
+	}
+
+	/** Takes whole lines, oldest first, up to max bytes. Always takes at least one line. */
+	bool pop(std::string &out, std::string::size_type max)
+	{
+		out.clear();
+		if (fileRead < fileSize && fromFile(out, max))
+			return true;
+		if (memory.empty())
+			return false;
+
+		std::string &front = memory.front();
+		std::string::size_type cut = lineCut(front, max);
+		memoryBytes -= cut;
+		if (cut == front.size())
+		{
+			out.swap(front);
+			memory.pop_front();
+		}
+		else
+		{
+			out.assign(front, 0, cut);
+			front.erase(0, cut);
+		}
+		return true;
+	}
+};
+
+/** An append-only line protocol file with a copy of every flush, for forensics on servers with no
+ * Telegraf to send to. The lines carry their own timestamps, so the file can be loaded into
+ * InfluxDB as it is, e.g. with "influx write --precision ns".
+ *
+ * The file stays open and each flush is a single write. It is rotated to <file>.1, <file>.2 and
+ * so on, keeping up to a set number of old files, once it would grow past a size or gets too old.
+ */
+class MetricsArchive
+{
+	std::string path;
+	off_t maxSize;
+	time_t maxAge;
+	unsigned int keep;
+	int fd;
+	off_t size;
+	time_t opened;
+
+	bool openFile(time_t now)
+	{
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+		if (fd < 0)
+		{
+			ServerInstance->Logs->Log("TELEGRAF", DEFAULT, "Can't open archive file %s: %s", path.c_str(),
+									  strerror(errno));
+			return false;
+		}
+		struct stat st;
+		size = fstat(fd, &st) == 0 ? st.st_size : 0;
+		opened = now;
+		return true;
+	}
+
+	void closeFile()
+	{
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+
+	void rotate(time_t now)
+	{
+		closeFile();
+		if (!keep)
+		{
+			unlink(path.c_str());
+		}
+		else
+		{
+			for (unsigned int i = keep; i > 1; --i)
+				rename((path + "." + ConvToStr(i - 1)).c_str(), (path + "." + ConvToStr(i)).c_str());
+			rename(path.c_str(), (path + ".1").c_str());
+		}
+		openFile(now);
+	}
+
+	void drop(const std::string &lines)
+	{
+		dropped += std::count(lines.begin(), lines.end(), '\n');
+	}
+
+ public:
+	/** Number of lines that could not be written */
+	unsigned long dropped;
+
+	MetricsArchive() : maxSize(0), maxAge(0), keep(0), fd(-1), size(0), opened(0), dropped(0)
+	{
+	}
+
+	~MetricsArchive()
+	{
+		closeFile();
+	}
+
+	void configure(const std::string &file, off_t sizeLimit, time_t ageLimit, unsigned int files)
+	{
+		maxSize = sizeLimit;
+		maxAge = ageLimit;
+		keep = files;
+		if (file == path)
+			return;
+
+		closeFile();
+		path = file;
+	}
+
+	bool enabled() const
+	{
+		return !path.empty();
+	}
+
+	const std::string &getPath() const
+	{
+		return path;
+	}
+
+	off_t getSize() const
+	{
+		return size;
+	}
+
+	void append(const std::string &lines, time_t now)
+	{
+		if (path.empty() || lines.empty())
+			return;
+
+		if (fd < 0 && !openFile(now))
+		{
+			drop(lines);
+			return;
+		}
+		if (size && ((maxSize && size + static_cast<off_t>(lines.size()) > maxSize) || (maxAge && now - opened >= maxAge)))
+			rotate(now);
+		if (fd < 0)
+		{
+			drop(lines);
+			return;
+		}
+
+		ssize_t written = write(fd, lines.data(), lines.size());
+		if (written != static_cast<ssize_t>(lines.size()))
+		{
+			ServerInstance->Logs->Log("TELEGRAF", DEFAULT, "Can't write to archive file %s: %s", path.c_str(),
+									  written < 0 ? strerror(errno) : "short write");
+			// Don't leave a torn line behind for the replay to trip over
+			if (written > 0 && ftruncate(fd, size) < 0)
+				size += written;
+			drop(lines);
+			return;
+		}
+		size += written;
+	}
+};
+
+class TelegrafModule;
+
+struct LoopAction : public HandlerBase0<void>
+{
+	TelegrafModule *creator;
+
+	LoopAction(TelegrafModule *m) : creator(m)
+	{
+	}
+
+	void Call();
+};
+
+struct IterationAction : public HandlerBase0<void>
+{
+	TelegrafModule *creator;
+
+	IterationAction(TelegrafModule *m) : creator(m)
+	{
+	}
+
+	void Call();
+};
+
+/** Marks the start of the actions phase of an iteration, see TelegrafModule::IterationStart */
+struct PhaseAction : public HandlerBase0<void>
+{
+	TelegrafModule *creator;
+
+	PhaseAction(TelegrafModule *m) : creator(m)
+	{
+	}
+
+	void Call();
+};
+
+/** Marks the start of the culls phase of an iteration.
+ *
+ * GlobalCulls.Apply() culls everything in the order it was queued and then deletes it, so the
+ * marker is queued again every iteration, see TelegrafModule::IterationStart. To keep that off
+ * the heap it is always constructed in the same static storage, and deleting it only runs the
+ * destructor.
+ */
+class CullMarker : public classbase
+{
+ public:
+	TelegrafModule *creator;
+
+	CullMarker(TelegrafModule *m) : creator(m)
+	{
+	}
+
+	CullResult cull();
+
+	static void *operator new(size_t, void *where)
+	{
+		return where;
+	}
+
+	static void operator delete(void *, void *)
+	{
+	}
+
+	static void operator delete(void *)
+	{
+	}
+};
+
+static union
+{
+	char bytes[sizeof(CullMarker)];
+	void *pointer;
+	long double number;
+} cullMarkerStorage;
+
+/** Provides a callback at the start of every main loop iteration without waking the loop up.
+ *
+ * The probe owns an idle pipe which is registered with the socket engine but never polled.
+ * Requesting a trial write on it makes the socket engine call HandleEvent() from
+ * DispatchTrialWrites(), which runs once per iteration right before DispatchEvents().
+ */
+class LoopProbe : public EventHandler
+{
+	TelegrafModule *creator;
+	int pipefd[2];
+
+ public:
+	LoopProbe(TelegrafModule *m) : creator(m)
+	{
+		if (pipe(pipefd))
+		{
+			pipefd[0] = pipefd[1] = -1;
+			return;
+		}
+		ServerInstance->SE->NonBlocking(pipefd[0]);
+		ServerInstance->SE->NonBlocking(pipefd[1]);
+		SetFd(pipefd[0]);
+		if (!ServerInstance->SE->AddFd(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE))
+			SetFd(-1);
+	}
+
+	void arm()
+	{
+		if (GetFd() > -1)
+			ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+	}
+
+	void HandleEvent(EventType et, int errornum);
+
+	CullResult cull()
+	{
+		if (GetFd() > -1)
+			ServerInstance->SE->DelFd(this);
+		if (pipefd[0] > -1)
+			ServerInstance->SE->Close(pipefd[0]);
+		if (pipefd[1] > -1)
+			ServerInstance->SE->Close(pipefd[1]);
+		SetFd(-1);
+		return EventHandler::cull();
+	}
+};
+
+/** Lays out the hook profiler's probes once the module lists have settled */
+struct HookLayoutAction : public HandlerBase0<void>
+{
+	TelegrafModule *creator;
+
+	HookLayoutAction(TelegrafModule *m) : creator(m)
+	{
+	}
+
+	void Call();
+};
+
+/** Charges the hook calls that stopped their events early, see HookProfiler::closeOpen */
+struct HookCloseAction : public HandlerBase0<void>
+{
+	TelegrafModule *creator;
+
+	HookCloseAction(TelegrafModule *m) : creator(m)
+	{
+	}
+
+	void Call();
+};
+
+struct LoopLagTimer : public Timer
+{
+	TelegrafModule *creator;
+
+	LoopLagTimer(TelegrafModule *m) : Timer(0, 0, true), creator(m)
+	{
+	}
+
+	void Tick(time_t);
+};
+
+/** Wakes the main loop up every flush interval, which 2.0's timers can't do below a second.
+ *
+ * Uses a timerfd, so it only works on Linux. Elsewhere, or if the timerfd can't be set up,
+ * flushes are only checked on LoopLagTimer's ticks, once a second.
+ */
+class FlushTimer : public EventHandler
+{
+	TelegrafModule *creator;
+
+ public:
+	FlushTimer(TelegrafModule *m, unsigned long interval) : creator(m)
+	{
+#ifdef __linux__
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (fd < 0)
+			return;
+		itimerspec spec;
+		spec.it_interval.tv_sec = interval / 1000;
+		spec.it_interval.tv_nsec = (interval % 1000) * 1000000;
+		spec.it_value = spec.it_interval;
+		SetFd(fd);
+		if (timerfd_settime(fd, 0, &spec, NULL) < 0 || !ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		{
+			ServerInstance->SE->Close(fd);
+			SetFd(-1);
+		}
+#endif
+	}
+
+	void HandleEvent(EventType et, int errornum);
+
+	CullResult cull()
+	{
+		if (GetFd() > -1)
+		{
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Close(GetFd());
+		}
+		SetFd(-1);
+		return EventHandler::cull();
+	}
+};
+
+/** Somewhere encoded metrics can be sent to */
+class TelegrafTransport
+{
+ public:
+	/** Number of lines thrown away because the transport could not take them */
+	unsigned long dropped;
+
+	TelegrafTransport() : dropped(0)
+	{
+	}
+
+	virtual ~TelegrafTransport()
+	{
+	}
+
+	/** Returns how many bytes the transport can take right now without dropping any */
+	virtual std::string::size_type Room() = 0;
+
+	/** Whether the transport can take a flush right now, otherwise it should be spooled */
+	bool IsReady()
+	{
+		return Room() > 0;
+	}
+
+	/** Sends a buffer of complete lines, never blocking */
+	virtual void Send(const std::string &lines) = 0;
+
+	virtual std::string GetTransportError() = 0;
+
+	/** Queues the transport to be closed and deleted */
+	virtual void Destroy() = 0;
+
+	void Drop(const std::string &lines, std::string::size_type start = 0)
+	{
+		dropped += std::count(lines.begin() + start, lines.end(), '\n');
+	}
+};
+
+class TelegrafSocket : public BufferedSocket, public TelegrafTransport
+{
+	TelegrafModule *creator;
+	unsigned long maxSendQ;
+	bool connected;
+
+ public:
+	TelegrafSocket(TelegrafModule *m, const std::string &host, int port, unsigned long sendq)
+			: creator(NULL), maxSendQ(sendq), connected(false)
+	{
+		// A connect that fails straight away, as a refused one over loopback does, calls OnError from
+		// here, before the module holds this socket. It checks HasFailed() instead.
+		DoConnect(host, port, 60, "");
+		creator = m;
+	}
+
+	bool HasFailed()
+	{
+		return !getError().empty();
+	}
+
+	void OnConnected()
+	{
+		connected = true;
+	}
+
+	void OnError(BufferedSocketError);
+
+	void OnDataReady()
+	{
+		recvq.clear();
+	}
+
+	std::string::size_type Room()
+	{
+		// Anything written before the connection is up would be lost if it fails
+		if (!connected || GetFd() < 0 || getSendQSize() >= maxSendQ)
+			return 0;
+		return maxSendQ - getSendQSize();
+	}
+
+	void Send(const std::string &lines)
+	{
+		// Telegraf is not keeping up, don't let the backlog grow inside the ircd
+		if (getSendQSize() + lines.size() > maxSendQ)
+		{
+			Drop(lines);
+			return;
+		}
+		WriteData(lines);
+	}
+
+	std::string GetTransportError()
+	{
+		return getError();
+	}
+
+	void Destroy()
+	{
+		ServerInstance->GlobalCulls.AddItem(this);
+	}
+};
+
+/** Sends metrics as udp or unix datagrams, packing as many whole lines into each as fit */
+class TelegrafDatagram : public classbase, public TelegrafTransport
+{
+	int fd;
+	irc::sockets::sockaddrs addr;
+	sockaddr_un unixAddr;
+	bool isUnix;
+	bool valid;
+	bool connected;
+	std::string::size_type mtu;
+	std::string error;
+
+	bool Connect()
+	{
+		if (!valid)
+			return false;
+		if (fd < 0)
+		{
+			fd = socket(isUnix ? AF_UNIX : addr.sa.sa_family, SOCK_DGRAM, 0);
+			if (fd < 0)
+			{
+				error = strerror(errno);
+				return false;
+			}
+			ServerInstance->SE->NonBlocking(fd);
+		}
+
+		// The listener may not exist yet for unixgram, so this is retried on every flush
+		int res = isUnix ? connect(fd, reinterpret_cast<sockaddr *>(&unixAddr), sizeof(unixAddr))
+						 : connect(fd, &addr.sa, addr.sa_size());
+		if (res < 0)
+		{
+			error = strerror(errno);
+			return false;
+		}
+		connected = true;
+		return true;
+	}
+
+	bool SendPacket(const char *data, std::string::size_type len)
+	{
+		if (send(fd, data, len, MSG_DONTWAIT) >= 0)
+			return true;
+
+		error = strerror(errno);
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+			connected = false;
+		return false;
+	}
+
+ public:
+	TelegrafDatagram(const std::string &host, int port, std::string::size_type maxlen)
+			: fd(-1), isUnix(false), valid(false), connected(false), mtu(maxlen)
+	{
+		if (!irc::sockets::aptosa(host, port, addr))
+			error = "Invalid address " + host;
+		else
+		{
+			valid = true;
+			Connect();
+		}
+	}
+
+	TelegrafDatagram(const std::string &path, std::string::size_type maxlen)
+			: fd(-1), isUnix(true), valid(false), connected(false), mtu(maxlen)
+	{
+		memset(&unixAddr, 0, sizeof(unixAddr));
+		unixAddr.sun_family = AF_UNIX;
+		if (path.length() >= sizeof(unixAddr.sun_path))
+			error = "Socket path too long: " + path;
+		else
+		{
+			strcpy(unixAddr.sun_path, path.c_str());
+			valid = true;
+			Connect();
+		}
+	}
+
+	std::string::size_type Room()
+	{
+		return (connected || Connect()) ? std::string::npos : 0;
+	}
+
+	void Send(const std::string &lines)
+	{
+		if (!connected && !Connect())
+		{
+			Drop(lines);
+			return;
+		}
+
+		std::string::size_type start = 0;
+		while (start < lines.size())
+		{
+			// Always send at least one line, then add more while they fit
+			std::string::size_type end = lines.find('\n', start);
+			end = (end == std::string::npos) ? lines.size() : end + 1;
+			while (end < lines.size())
+			{
+				std::string::size_type next = lines.find('\n', end);
+				next = (next == std::string::npos) ? lines.size() : next + 1;
+				if (next - start > mtu)
+					break;
+				end = next;
+			}
+
+			if (!SendPacket(lines.data() + start, end - start))
+			{
+				Drop(lines, start);
+				return;
+			}
+			start = end;
+		}
+	}
+
+	std::string GetTransportError()
+	{
+		return error;
+	}
+
+	void Destroy()
+	{
+		ServerInstance->GlobalCulls.AddItem(this);
+	}
+
+	CullResult cull()
+	{
+		if (fd > -1)
+			ServerInstance->SE->Close(fd);
+		fd = -1;
+		return classbase::cull();
+	}
+};
+
+class PrometheusExporter;
+
+/** A connection from a Prometheus scraper. Connections are kept alive between scrapes. */
+class PrometheusClient : public BufferedSocket
+{
+	PrometheusExporter *exporter;
+
+ public:
+	time_t lastActive;
+	bool closing;
+
+	PrometheusClient(PrometheusExporter *e, int newfd)
+			: BufferedSocket(newfd), exporter(e), lastActive(ServerInstance->Time()), closing(false)
+	{
+	}
+
+	void OnDataReady();
+
+	void OnError(BufferedSocketError);
+};
+
+/** Accepts scrape connections on a tcp port or a unix socket */
+class PrometheusListener : public EventHandler
+{
+	PrometheusExporter *exporter;
+	std::string unixPath;
 
-	Metrics() : lastLoopTime(0)
+ public:
+	std::string error;
+
+	PrometheusListener(PrometheusExporter *e, const std::string &host, int port, const std::string &path)
+			: exporter(e), unixPath(path)
 	{
+		irc::sockets::sockaddrs addr;
+		sockaddr_un unixAddr;
+		sockaddr *sa;
+		socklen_t len;
+		if (!path.empty())
+		{
+			memset(&unixAddr, 0, sizeof(unixAddr));
+			unixAddr.sun_family = AF_UNIX;
+			if (path.length() >= sizeof(unixAddr.sun_path))
+			{
+				error = "Socket path too long: " + path;
+				return;
+			}
+			strcpy(unixAddr.sun_path, path.c_str());
+			sa = reinterpret_cast<sockaddr *>(&unixAddr);
+			len = sizeof(unixAddr);
+			// Clean up after an ircd that did not shut down cleanly
+			unlink(path.c_str());
+		}
+		else if (irc::sockets::aptosa(host, port, addr))
+		{
+			sa = &addr.sa;
+			len = addr.sa_size();
+		}
+		else
+		{
+			error = "Invalid address " + host;
+			return;
+		}
+
+		int newfd = socket(sa->sa_family, SOCK_STREAM, 0);
+		if (newfd < 0)
+		{
+			error = strerror(errno);
+			return;
+		}
+		int on = 1;
+		setsockopt(newfd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char *>(&on), sizeof(on));
+		if (bind(newfd, sa, len) < 0 || listen(newfd, 16) < 0)
+		{
+			error = strerror(errno);
+			close(newfd);
+			return;
+		}
+		ServerInstance->SE->NonBlocking(newfd);
+		SetFd(newfd);
+		if (!ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		{
+			error = "Can't add the listener to the socket engine";
+			ServerInstance->SE->Close(newfd);
+			SetFd(-1);
+		}
 	}
 
-	virtual ~Metrics()
+	void HandleEvent(EventType et, int errornum);
+
+	CullResult cull()
 	{
+		if (GetFd() > -1)
+		{
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Close(GetFd());
+			if (!unixPath.empty())
+				unlink(unixPath.c_str());
+		}
+		SetFd(-1);
+		return EventHandler::cull();
 	}
+};
 
-	void clear()
+/** Serves the last flush to Prometheus.
+ *
+ * The response is rendered once per flush, so a scrape costs one write of a cached buffer no
+ * matter how often it happens.
+ */
+class PrometheusExporter
+{
+	static const unsigned int MAX_CLIENTS = 16;
+	static const time_t IDLE_TIMEOUT = 60;
+	static const std::string::size_type MAX_REQUEST = 8192;
+
+	PrometheusListener *listener;
+	std::set<PrometheusClient *> clients;
+	std::string body;
+	std::string response;
+	std::string::size_type headerLength;
+
+	void SetResponse(const char *status, const std::string &content)
 	{
-		loopTimes.clear();
-		lastLoopTime = 0;
+		response.assign("HTTP/1.1 ").append(status);
+		response.append("\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ");
+		response.append(ConvToStr(content.size())).append("\r\n\r\n");
+		headerLength = response.size();
+		response.append(content);
 	}
 
-	void addLoopTime(const std::clock_t t)
+ public:
+	PrometheusEncoder encoder;
+	const std::string description;
+
+	PrometheusExporter(const std::string &host, int port, const std::string &path)
+			: headerLength(0), description(path.empty() ? host + ":" + ConvToStr(port) : path)
 	{
-		loopTimes.push_back(t - lastLoopTime);
+		listener = new PrometheusListener(this, host, port, path);
+		SetResponse("503 Service Unavailable", "No metrics collected yet\n");
 	}
 
-	std::clock_t getAverageLoopTime()
+	~PrometheusExporter()
 	{
-		if (loopTimes.empty())
-			return 0;
-		std::clock_t total = 0;
-		for (LoopTimes::size_type i = 0; i < loopTimes.size(); ++i)
-			total += loopTimes[i];
-		return total / loopTimes.size();
+		ServerInstance->GlobalCulls.AddItem(listener);
+		for (std::set<PrometheusClient *>::iterator i = clients.begin(); i != clients.end(); ++i)
+		{
+			(*i)->Close();
+			ServerInstance->GlobalCulls.AddItem(*i);
+		}
 	}
-};
 
-struct TelegrafLine
-{
-	std::string name;
-	std::map<std::string, std::string> tags;
-	std::map<std::string, std::string> fields;
-
-	TelegrafLine()
+	const std::string &GetError() const
 	{
+		return listener->error;
 	}
 
-	virtual ~TelegrafLine()
+	unsigned long GetClientCount() const
 	{
+		return clients.size();
 	}
 
-	void clear()
+	/** Renders what the encoder collected into the response served until the next flush */
+	void Publish()
 	{
-		name.clear();
-		tags.clear();
-		fields.clear();
+		body.clear();
+		encoder.render(body);
+		SetResponse("200 OK", body);
 	}
 
-	std::string escapeTag(const std::string &in)
+	void Accept(int newfd)
 	{
-		std::string out;
-		for (std::string::const_iterator i = in.begin(); i != in.end(); i++)
+		if (clients.size() >= MAX_CLIENTS)
 		{
-			char c = *i;
-			switch (c)
-			{
-				case ',':
-				case ' ':
-				case '=':
-				case '\\':
-					out += '\\';
-				default:
-					out += c;
-			}
+			ServerInstance->SE->Close(newfd);
+			return;
 		}
-		return out;
+		ServerInstance->SE->NonBlocking(newfd);
+		clients.insert(new PrometheusClient(this, newfd));
 	}
 
-	std::string escapeValue(const std::string &in)
+	void Remove(PrometheusClient *client)
 	{
-		std::string out;
-		for (std::string::const_iterator i = in.begin(); i != in.end(); i++)
+		if (clients.erase(client))
 		{
-			switch (*i)
-			{
-				case '"':
-				case '\\':
-					out += '\\';
-				default:
-					out += *i;
-			}
+			client->Close();
+			ServerInstance->GlobalCulls.AddItem(client);
 		}
-		return out;
 	}
 
-	std::string format()
+	/** Answers every complete request waiting in the client's recvq */
+	void Serve(PrometheusClient *client, std::string &recvq)
 	{
-		std::string out(name);
-		for (std::map<std::string, std::string>::const_iterator i = tags.begin(); i != tags.end(); i++)
+		client->lastActive = ServerInstance->Time();
+		for (;;)
 		{
-			out += "," + escapeTag(i->first) + "=" + escapeTag(i->second);
-		}
-		bool first = true;
-		for (std::map<std::string, std::string>::const_iterator i = fields.begin(); i != fields.end(); i++)
-		{
-			if (first)
+			std::string::size_type end = recvq.find("\r\n\r\n");
+			if (end == std::string::npos)
 			{
-				out += " ";
-				first = false;
+				if (recvq.size() > MAX_REQUEST)
+					Remove(client);
+				return;
 			}
+			std::string request(recvq, 0, end);
+			recvq.erase(0, end + 4);
+
+			irc::spacesepstream tokens(request.substr(0, request.find('\r')));
+			std::string method, target, version;
+			tokens.GetToken(method);
+			tokens.GetToken(target);
+			tokens.GetToken(version);
+			target.erase(std::min(target.find('?'), target.size()));
+
+			std::transform(request.begin(), request.end(), request.begin(), ::tolower);
+			if (version != "HTTP/1.1" || request.find("\r\nconnection: close") != std::string::npos)
+				client->closing = true;
+
+			if (method != "GET" && method != "HEAD")
+				client->WriteData("HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\n\r\n");
+			else if (target != "/metrics" && target != "/")
+				client->WriteData("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+			else if (method == "HEAD")
+				client->WriteData(response.substr(0, headerLength));
 			else
+				client->WriteData(response);
+
+			if (client->closing)
 			{
-				out += ",";
+				recvq.clear();
+				return;
 			}
-			out += escapeTag(i->first) + "=" + escapeValue(i->second);
 		}
-		return out + "\n";
 	}
-};
-
-class TelegrafModule;
-
-struct LoopAction : public HandlerBase0<void>
-{
-	TelegrafModule *creator;
 
-	LoopAction(TelegrafModule *m) : creator(m)
+	/** Closes idle connections, and those that asked to be closed once their response is out */
+	void Expire(time_t now)
 	{
+		std::set<PrometheusClient *>::iterator i = clients.begin();
+		while (i != clients.end())
+		{
+			PrometheusClient *client = *i++;
+			if ((client->closing && !client->getSendQSize()) || now - client->lastActive > IDLE_TIMEOUT)
+				Remove(client);
+		}
 	}
-
-	void Call();
 };
 
-struct LoopLagTimer : public Timer
+void PrometheusClient::OnDataReady()
 {
-	TelegrafModule *creator;
-
-	LoopLagTimer(TelegrafModule *m) : Timer(0, 0, true), creator(m)
-	{
-	}
-
-	void Tick(time_t);
-};
+	if (!closing)
+		exporter->Serve(this, recvq);
+	else
+		recvq.clear();
+}
 
-class TelegrafSocket : public BufferedSocket
+void PrometheusClient::OnError(BufferedSocketError)
 {
-	TelegrafModule *creator;
-
- public:
-	TelegrafSocket(TelegrafModule *m, int port) : creator(m)
-	{
-		DoConnect("127.0.0.1", port, 60, "");
-	}
+	exporter->Remove(this);
+}
 
-	void OnError(BufferedSocketError);
+void PrometheusListener::HandleEvent(EventType et, int errornum)
+{
+	if (et != EVENT_READ)
+		return;
 
-	void OnDataReady()
+	// Prometheus only ever holds a handful of connections, no need to drain the backlog in one go
+	for (unsigned int i = 0; i < 4; ++i)
 	{
-		recvq.clear();
+		int newfd = accept(GetFd(), NULL, NULL);
+		if (newfd < 0)
+			return;
+		exporter->Accept(newfd);
 	}
-
-	void SendMetrics();
-
-	TelegrafLine GetMetrics();
-};
+}
 
 class TelegrafCommand : public Command
 {
@@ -210,7 +3407,7 @@ class TelegrafCommand : public Command
 			: Command(parent, "TELEGRAF", 1),
 			  actions(cmd_actions, cmd_actions + sizeof(cmd_actions) / sizeof(cmd_actions[0]))
 	{
-		syntax = "{start|stop|restart|status} [<servername>]";
+		syntax = "{start|stop|restart|status|sample|stalls} [<servername>]";
 		flags_needed = 'o';
 	}
 
@@ -224,38 +3421,120 @@ class TelegrafCommand : public Command
 	CmdResult Handle(const std::vector<std::string> &parameters, User *user);
 };
 
+/** Receives metric summaries from other servers over ENCAP, see NetworkAggregator */
+class TelegrafSummaryCommand : public Command
+{
+ public:
+	TelegrafSummaryCommand(Module *parent) : Command(parent, "TELEGRAFSUM", 1, 1)
+	{
+		syntax = "<summary>";
+	}
+
+	CmdResult Handle(const std::vector<std::string> &parameters, User *user);
+};
+
 class TelegrafModule : public Module
 {
  public:
 	Metrics metrics;
+	HookProfiler profiler;
 
  private:
 	bool shouldReconnect;
 	bool silent;
+	bool sampleIterations;
+	bool commandStats;
+	/* The commands OnPreCommand started timing, innermost last, as deep as CommandStats goes. Aliases
+	 * nest them, and one denied by a later module never reaches OnPostCommand */
+	struct TimedCommand
+	{
+		/* Only compared, the string belongs to ProcessCommand */
+		const std::string *key;
+		std::string name;
+		std::string uuid;
+	} timedCommands[CommandStats::MAX_DEPTH];
+	unsigned int timedDepth;
+	bool profileHooks;
+	bool layoutPending;
+	std::string transportType;
+	std::string host;
+	std::string path;
 	int port;
+	std::string::size_type mtu;
+	unsigned long maxSendQ;
 	long reconnectTimeout;
-	time_t lastReconnect;
+	long maxReconnect;
+	unsigned int reconnectAttempts;
+	time_t nextReconnect;
+	/* Milliseconds between flushes */
+	unsigned long flushInterval;
+	unsigned long long nextFlush;
+	CollectorSchedule schedule;
+	std::string::size_type replayRate;
+	MetricsSpool spool;
+	MetricsArchive archive;
+	WhowasCollector whowas;
+	ProcessCollector process;
+	StallLog stalls;
+	TopTalkers talkers;
+	unsigned int reportTalkers;
+	SimpleExtItem<RegistrationStats::Progress> registering;
+	LinkTracker links;
+	std::string prometheusHost;
+	std::string prometheusPath;
+	int prometheusPort;
+	PrometheusExporter *exporter;
 	LoopLagTimer *timer;
+	FlushTimer *flushTimer;
 	LoopAction *action;
-	TelegrafSocket *tSock;
+	IterationAction *iterationAction;
+	PhaseAction *phaseAction;
+	CullMarker *cullMarker;
+	HookLayoutAction *layoutAction;
+	HookCloseAction *closeAction;
+	LoopProbe *probe;
+	TelegrafTransport *transport;
+	LineEncoder encoder;
+	NetworkAggregator network;
+	std::string aggregateTo;
+	/* CommandStats::finished as of the last summary sent to aggregateTo */
+	unsigned long long summaryCommands;
 	TelegrafCommand cmd;
+	TelegrafSummaryCommand summaryCmd;
 
 	friend class TelegrafCommand;
+	friend class TelegrafSummaryCommand;
 
  public:
 	TelegrafModule()
-			: shouldReconnect(false), silent(false), port(0), reconnectTimeout(0), lastReconnect(0), timer(NULL),
-			  action(NULL), tSock(NULL), cmd(this)
+			: shouldReconnect(false), silent(false), sampleIterations(false), commandStats(false), timedDepth(0),
+			  profileHooks(false), layoutPending(false), port(0), mtu(0), maxSendQ(0), reconnectTimeout(0), maxReconnect(0),
+			  reconnectAttempts(0), nextReconnect(0), flushInterval(0), nextFlush(0), replayRate(0), reportTalkers(0),
+			  registering("telegraf_registration", this), prometheusPort(0), exporter(NULL), timer(NULL), flushTimer(NULL),
+			  action(NULL), iterationAction(NULL), phaseAction(NULL), cullMarker(NULL), layoutAction(NULL), closeAction(NULL), probe(NULL), transport(NULL), summaryCommands(0), cmd(this),
+			  summaryCmd(this)
 	{
 	}
 
 	void init()
 	{
+		profiler.stalls = &stalls;
 		timer = new LoopLagTimer(this);
 		action = new LoopAction(this);
+		iterationAction = new IterationAction(this);
+		phaseAction = new PhaseAction(this);
+		layoutAction = new HookLayoutAction(this);
+		closeAction = new HookCloseAction(this);
+		profiler.closer = closeAction;
+		profiler.owner = this;
 		ServerInstance->Timers->AddTimer(timer);
 		ServerInstance->Modules->AddService(cmd);
-		Implementation eventlist[] = {I_OnRehash, I_OnBackgroundTimer};
+		ServerInstance->Modules->AddService(summaryCmd);
+		ServerInstance->Modules->AddService(registering);
+		Implementation eventlist[] = {I_OnRehash, I_OnBackgroundTimer, I_OnPreCommand, I_OnPostCommand,
+									  I_OnLoadModule, I_OnUnloadModule, I_OnUserPreMessage, I_OnUserPreNotice,
+									  I_OnUserInit, I_OnCheckReady, I_OnUserConnect, I_OnUserDisconnect, I_OnSendSnotice,
+									  I_OnSyncNetwork, I_OnSyncUser, I_OnSyncChannel};
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist) / sizeof(Implementation));
 		OnRehash(NULL);
 	}
@@ -264,67 +3543,531 @@ class TelegrafModule : public Module
 	{
 		ConfigTag *tag = ServerInstance->Config->ConfValue("telegraf");
 		silent = tag->getBool("silent");
+		unsigned long newFlushInterval = std::max(parseInterval(tag->getString("interval"), 5000), 250UL);
+		if (newFlushInterval != flushInterval)
+		{
+			flushInterval = newFlushInterval;
+			nextFlush = monotonicMicros() + flushInterval * 1000ULL;
+			if (flushTimer)
+				ServerInstance->GlobalCulls.AddItem(flushTimer);
+			flushTimer = new FlushTimer(this, flushInterval);
+		}
 		reconnectTimeout = tag->getInt("reconnect", 60);
+		maxReconnect = std::max(reconnectTimeout, tag->getInt("maxreconnect", 1800));
+		spool.configure(tag->getInt("spoolsize", 1048576), tag->getString("spoolfile"),
+						tag->getInt("spoolfilesize", 67108864));
+		replayRate = std::max(tag->getInt("replayrate", 65536), 4096L);
+		archive.configure(tag->getString("archive"), tag->getInt("archivesize", 67108864),
+						  tag->getInt("archiveinterval", 86400), tag->getInt("archivekeep", 7));
+		bool newSampleIterations = tag->getBool("sampleiterations");
+		if (newSampleIterations && !sampleIterations)
+		{
+			if (!probe)
+				probe = new LoopProbe(this);
+			probe->arm();
+		}
+		sampleIterations = newSampleIterations;
+		commandStats = tag->getBool("commandstats", true);
+		stalls.threshold = tag->getInt("stallthreshold", 500) * 1000ULL;
+		stalls.notify = tag->getBool("stallsnotice");
+		reportTalkers = std::min<unsigned int>(tag->getInt("toptalkers"), TopTalkers::MAX_REPORTED);
+		aggregateTo = tag->getString("aggregateto");
+		ConfigureCollectors(tag);
+		bool newProfileHooks = tag->getBool("hookprofiler");
+		if (newProfileHooks != profileHooks)
+		{
+			profileHooks = newProfileHooks;
+			ScheduleHookLayout();
+		}
+		std::string newTransportType = tag->getString("transport", "tcp");
+		std::string newHost = tag->getString("host", "127.0.0.1");
+		std::string newPath = tag->getString("path");
 		int new_port = tag->getInt("port");
-		if (port != new_port)
+		mtu = tag->getInt("mtu", newTransportType == "unixgram" ? 8192 : 1400);
+		if (mtu < 512)
+			mtu = 512;
+		maxSendQ = tag->getInt("sendq", 1048576);
+		if (newTransportType != "tcp" && newTransportType != "udp" && newTransportType != "unixgram")
 		{
-			if (tSock)
+			ServerInstance->Logs->Log("TELEGRAF", DEFAULT, "Unknown transport \"%s\", falling back to tcp",
+									  newTransportType.c_str());
+			newTransportType = "tcp";
+		}
+		if (port != new_port || transportType != newTransportType || host != newHost || path != newPath)
+		{
+			if (transport)
 			{
 				StopMetrics();
 			}
 			port = new_port;
-			if (port > 0 && port < 65536)
+			transportType = newTransportType;
+			host = newHost;
+			path = newPath;
+			if (IsConfigured())
 			{
 				StartMetrics();
 			}
 		}
+
+		std::string newPrometheusHost = tag->getString("prometheushost", "127.0.0.1");
+		std::string newPrometheusPath = tag->getString("prometheuspath");
+		int newPrometheusPort = tag->getInt("prometheusport");
+		if (newPrometheusHost != prometheusHost || newPrometheusPath != prometheusPath ||
+			newPrometheusPort != prometheusPort)
+		{
+			prometheusHost = newPrometheusHost;
+			prometheusPath = newPrometheusPath;
+			prometheusPort = newPrometheusPort;
+			StartExporter();
+		}
+	}
+
+	void StartExporter()
+	{
+		delete exporter;
+		exporter = NULL;
+		if (prometheusPath.empty() && (prometheusPort <= 0 || prometheusPort >= 65536))
+			return;
+
+		exporter = new PrometheusExporter(prometheusHost, prometheusPort, prometheusPath);
+		exporter->encoder.setRetention(schedule.longest() + 1);
+		if (!exporter->GetError().empty())
+		{
+			ServerInstance->Logs->Log("TELEGRAF", DEFAULT, "Can't listen for Prometheus on %s: %s",
+									  exporter->description.c_str(), exporter->GetError().c_str());
+		}
+	}
+
+	void ConfigureCollectors(ConfigTag *tag)
+	{
+		std::set<std::string> expensive;
+		irc::spacesepstream names(tag->getString("expensive", "whowas process"));
+		std::string name;
+		while (names.GetToken(name))
+			expensive.insert(name);
+		unsigned long expensiveInterval = parseInterval(tag->getString("expensiveinterval"), 60000);
+
+		unsigned int periods[CollectorSchedule::COUNT];
+		for (unsigned int i = 0; i < CollectorSchedule::COUNT; ++i)
+		{
+			// <name>interval overrides the interval given by the expensive list
+			std::string key = std::string(CollectorSchedule::name(i)) + "interval";
+			unsigned long interval =
+				parseInterval(tag->getString(key), expensive.count(CollectorSchedule::name(i)) ? expensiveInterval : 0);
+			periods[i] = (interval + flushInterval / 2) / flushInterval;
+		}
+		schedule.configure(periods);
+		whowas.stale = process.stale = true;
+		if (exporter)
+			exporter->encoder.setRetention(schedule.longest() + 1);
+	}
+
+	bool IsConfigured()
+	{
+		if (transportType == "unixgram")
+			return !path.empty();
+		return port > 0 && port < 65536;
+	}
+
+	std::string DescribeTransport()
+	{
+		if (transportType == "unixgram")
+			return "unixgram " + path;
+		return transportType + " " + host + ":" + ConvToStr(port);
+	}
+
+	/** Whether metrics are being collected, which they still are while waiting to reconnect */
+	bool IsRunning()
+	{
+		return transport || shouldReconnect;
+	}
+
+	/** Whether metrics are being collected for Telegraf, Prometheus or the aggregating server */
+	bool IsCollecting()
+	{
+		return IsRunning() || exporter || !aggregateTo.empty() || archive.enabled();
+	}
+
+	/** Whether this is the server the others send their summaries to */
+	bool IsAggregator()
+	{
+		return aggregateTo == ServerInstance->Config->ServerName;
+	}
+
+	void OnBackgroundTimer(time_t curtime)
+	{
+		if (exporter)
+			exporter->Expire(curtime);
+	}
+
+	void ScheduleReconnect()
+	{
+		// Jitter, so servers that lost the same Telegraf don't all come back at once
+		long delay = reconnectDelay(reconnectTimeout, maxReconnect, reconnectAttempts);
+		delay = delay / 2 + ServerInstance->GenRandomInt(delay / 2 + 1);
+		nextReconnect = ServerInstance->Time() + delay;
+		reconnectAttempts++;
+		shouldReconnect = true;
+	}
+
+	void LoopTick(bool first)
+	{
+		if (!IsCollecting())
+			return;
+
+		if (first)
+		{
+			// Triggered from the timer
+			metrics.lastLoopTime = monotonicMicros();
+			metrics.lastLoopCpu = processCpuMicros();
+			QueueAction(action);
+		}
+		else if (metrics.lastLoopTime)
+		{
+			// Triggered from the atomic call
+			metrics.addLoopTime(monotonicMicros(), processCpuMicros());
+		}
+	}
+
+	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user,
+						   bool validated, const std::string &original_line)
+	{
+		if (user->registered != REG_ALL)
+		{
+			RegistrationStats::Progress *progress = registering.get(user);
+			if (progress)
+			{
+				unsigned long long now = monotonicMicros();
+				metrics.registration.mark(*progress, RegistrationStats::STAGE_FIRST_LINE, now);
+				if (user->dns_done)
+					metrics.registration.mark(*progress, RegistrationStats::STAGE_DNS, now);
+			}
+		}
+
+		if (validated && commandStats && IsCollecting())
+		{
+			// The string starting another command means the one it was for never reached OnPostCommand
+			unsigned int stale = FindTimedCommand(command);
+			if (stale)
+				UnwindTimedCommands(stale - 1);
+			if (timedDepth < CommandStats::MAX_DEPTH)
+			{
+				TimedCommand &timed = timedCommands[timedDepth];
+				timed.key = &command;
+				timed.name.assign(command);
+				timed.uuid.assign(user->uuid);
+			}
+			timedDepth++;
+			SetStallCommand();
+			metrics.commands.start(command, monotonicMicros());
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnPostCommand(const std::string &command, const std::vector<std::string> &parameters, LocalUser *user,
+					   CmdResult result, const std::string &original_line)
+	{
+		if (user->registered != REG_ALL && (user->registered & REG_NICKUSER) == REG_NICKUSER)
+		{
+			RegistrationStats::Progress *progress = registering.get(user);
+			if (progress)
+				metrics.registration.mark(*progress, RegistrationStats::STAGE_NICKUSER, monotonicMicros());
+		}
+
+		// Collecting may have stopped while the command ran, e.g. for /TELEGRAF stop, but whatever was
+		// started must still be finished
+		if (timedDepth > CommandStats::MAX_DEPTH)
+		{
+			// Too deep to have been recorded, CommandStats doesn't time it either
+			timedDepth--;
+			metrics.commands.finish(command, monotonicMicros());
+			return;
+		}
+
+		unsigned int depth = FindTimedCommand(command);
+		if (!depth)
+			return;
+		UnwindTimedCommands(depth);
+		timedDepth--;
+		unsigned long long elapsed = metrics.commands.finish(command, monotonicMicros());
+		if (elapsed && stalls.threshold)
+			stalls.check("command", elapsed, "", "");
+		// Back to whatever this command was nested in
+		SetStallCommand();
+	}
+
+	/** Returns how deep the timed command handled with this string is, or 0 if it isn't one.
+	 * ProcessCommand passes the same string to OnPreCommand and OnPostCommand, which tells nested
+	 * commands apart.
+	 */
+	unsigned int FindTimedCommand(const std::string &command)
+	{
+		unsigned int depth = timedDepth < CommandStats::MAX_DEPTH ? timedDepth : CommandStats::MAX_DEPTH;
+		while (depth && timedCommands[depth - 1].key != &command)
+			depth--;
+		return depth;
+	}
+
+	/** Drops the timed commands nested deeper than depth, which were denied after OnPreCommand */
+	void UnwindTimedCommands(unsigned int depth)
+	{
+		for (; timedDepth > depth; --timedDepth)
+			metrics.commands.abandon();
+		SetStallCommand();
+	}
+
+	/** Points the stall log at the innermost command being handled */
+	void SetStallCommand()
+	{
+		unsigned int top = timedDepth < CommandStats::MAX_DEPTH ? timedDepth : CommandStats::MAX_DEPTH;
+		stalls.command = top ? &timedCommands[top - 1].name : NULL;
+		stalls.source = top ? &timedCommands[top - 1].uuid : NULL;
+	}
+
+	void OnUserInit(LocalUser *user)
+	{
+		if (IsCollecting())
+			registering.set(user, RegistrationStats::Progress(monotonicMicros()));
+	}
+
+	ModResult OnCheckReady(LocalUser *user)
+	{
+		// This runs last, so every other module has let the user through
+		RegistrationStats::Progress *progress = registering.get(user);
+		if (progress)
+		{
+			unsigned long long now = monotonicMicros();
+			metrics.registration.mark(*progress, RegistrationStats::STAGE_MODULES, now);
+			if (user->dns_done)
+				metrics.registration.mark(*progress, RegistrationStats::STAGE_DNS, now);
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
+	void OnUserConnect(LocalUser *user)
+	{
+		RegistrationStats::Progress *progress = registering.get(user);
+		if (!progress)
+			return;
+
+		// Stages that were never seen, e.g. a lookup that was not needed, are counted as skipped
+		// rather than as reached now, so they don't add made up times to their histograms
+		metrics.registration.mark(*progress, RegistrationStats::STAGE_REGISTERED, monotonicMicros());
+		metrics.registration.finish(*progress);
+		registering.unset(user);
+	}
+
+	void OnUserDisconnect(LocalUser *user)
+	{
+		if (registering.get(user))
+			metrics.registration.aborted++;
+	}
+
+	ModResult OnSendSnotice(char &snomask, std::string &type, const std::string &message)
+	{
+		if (snomask == 'l' || snomask == 'L')
+			links.snotice(message, monotonicMicros());
+		return MOD_RES_PASSTHRU;
+	}
+
+	/** Whether a sync event comes from spanningtree, the only protocol module whose opaque pointer we know */
+	static bool IsSpanningTree(Module *proto)
+	{
+		return proto && proto == ServerInstance->Modules->Find("m_spanningtree.so");
+	}
+
+	void OnSyncNetwork(Module *proto, void *opaque)
+	{
+		// For spanningtree the opaque pointer is the TreeSocket being burst to, which derives only from BufferedSocket
+		if (IsSpanningTree(proto))
+			links.syncNetwork(static_cast<BufferedSocket *>(opaque));
+	}
+
+	void OnSyncUser(User *user, Module *proto, void *opaque)
+	{
+		if (IsSpanningTree(proto))
+			links.syncUser();
+	}
+
+	void OnSyncChannel(Channel *chan, Module *proto, void *opaque)
+	{
+		if (IsSpanningTree(proto))
+			links.syncChannel();
+	}
+
+	void CountMessage(User *user, void *dest, int target_type, const std::string &text)
+	{
+		if (!reportTalkers || !IsCollecting())
+			return;
+
+		if (target_type == TYPE_CHANNEL)
+		{
+			Channel *chan = static_cast<Channel *>(dest);
+			talkers.channelMessages.add(chan->name, 1);
+			long recipients = chan->GetUserCounter() - (chan->HasUser(user) ? 1 : 0);
+			talkers.channelFanout.add(chan->name, text.length() * std::max(recipients, 0L));
+		}
+		if (IS_LOCAL(user))
+			talkers.userMessages.add(user->uuid, 1);
+	}
+
+	ModResult OnUserPreMessage(User *user, void *dest, int target_type, std::string &text, char status,
+							   CUList &exempt_list)
+	{
+		CountMessage(user, dest, target_type, text);
+		return MOD_RES_PASSTHRU;
+	}
+
+	ModResult OnUserPreNotice(User *user, void *dest, int target_type, std::string &text, char status,
+							  CUList &exempt_list)
+	{
+		CountMessage(user, dest, target_type, text);
+		return MOD_RES_PASSTHRU;
+	}
+
+	void Prioritize()
+	{
+		// Time as little of the other modules' command hooks as possible
+		ServerInstance->Modules->SetPriority(this, I_OnPreCommand, PRIORITY_LAST);
+		ServerInstance->Modules->SetPriority(this, I_OnPostCommand, PRIORITY_FIRST);
+		// Only called once every other module is ready for the user to register
+		ServerInstance->Modules->SetPriority(this, I_OnCheckReady, PRIORITY_LAST);
+		// See every link snotice, even ones another module goes on to block
+		ServerInstance->Modules->SetPriority(this, I_OnSendSnotice, PRIORITY_FIRST);
+	}
+
+	void OnLoadModule(Module *mod)
+	{
+		if (profileHooks)
+			ScheduleHookLayout();
+	}
+
+	void OnUnloadModule(Module *mod)
+	{
+		// This runs for this module too, from its own UnloadAction, see QueueAction
+		if (mod == this)
+			return;
+		if (profileHooks)
+			ScheduleHookLayout();
+	}
+
+	void ScheduleHookLayout()
+	{
+		// The handler lists may be iterated or reprioritised right now, so wait for the end of the
+		// loop, and don't trust where the probes are until then
+		profiler.suspend();
+		if (layoutPending)
+			return;
+		layoutPending = true;
+		QueueAction(layoutAction);
+	}
+
+	/** Queues an action to run at the end of this iteration.
+	 *
+	 * Queueing an unload or reload of this module sets Module::dying, and the UnloadAction runs the
+	 * module's cull and closes it before any action queued after it. Nothing is queued from then on,
+	 * so every action this module owns has run by the time cull() hands it to GlobalCulls.
+	 */
+	void QueueAction(HandlerBase0<void> *handler)
+	{
+		if (!dying)
+			ServerInstance->AtomicActions.AddAction(handler);
 	}
 
-	void OnBackgroundTimer(time_t curtime)
+	void LayoutHooks()
 	{
-		if (shouldReconnect && !tSock)
-		{
-			if ((curtime - lastReconnect) >= reconnectTimeout)
-			{
-				lastReconnect = curtime;
-				shouldReconnect = false;
-				StartMetrics(true);
-			}
-		}
-		else if ((tSock) && (tSock->GetFd() > -1))
-		{
-			tSock->SendMetrics();
-		}
+		layoutPending = false;
+		if (profileHooks)
+			profiler.install();
+		else
+			profiler.remove();
+		profiler.reset();
 	}
 
-	void LoopTick(bool first)
+	static unsigned long SocketEventCount()
+	{
+		return static_cast<unsigned long>(ServerInstance->SE->TotalEvents);
+	}
+
+	/** Splits each iteration into phases:
+	 *    timers:   from the end of the previous iteration until the probe fires, which covers
+	 *              timers and the other once-a-second work at the top of the loop
+	 *    dispatch: from the probe until the cull marker is culled, which covers waiting for and
+	 *              handling socket events; its CPU time is reported separately to tell the two apart
+	 *    culls:    from the cull marker until the phase action runs
+	 *    actions:  from the phase action until the iteration action runs
+	 * The phase boundaries are only as good as the queues they rely on. Objects queued for culling
+	 * before the probe fires are culled before the marker, and actions queued during the culls
+	 * phase run after the iteration action.
+	 */
+	void IterationStart()
 	{
-		if (!tSock)
+		// Triggered from the probe, before the socket engine dispatches events
+		if (!sampleIterations)
 			return;
 
-		if (first)
+		metrics.dispatchStart = monotonicMicros();
+		metrics.dispatchStartCpu = cpuMicros();
+		metrics.dispatchStartEvents = SocketEventCount();
+		QueueAction(phaseAction);
+		// The marker is culled every iteration, so it is only still queued if the loop changed
+		if (!cullMarker)
 		{
-			// Triggered from the timer
-			metrics.lastLoopTime = std::clock();
-			ServerInstance->AtomicActions.AddAction(action);
+			cullMarker = new (cullMarkerStorage.bytes) CullMarker(this);
+			ServerInstance->GlobalCulls.AddItem(cullMarker);
 		}
-		else if (metrics.lastLoopTime)
+	}
+
+	void CullsStart()
+	{
+		// Triggered from GlobalCulls.Apply(), after all events have been dispatched
+		cullMarker = NULL;
+		metrics.cullsStart = monotonicMicros();
+		metrics.cullsStartCpu = cpuMicros();
+		metrics.cullsStartEvents = SocketEventCount();
+		QueueAction(iterationAction);
+	}
+
+	void ActionsStart()
+	{
+		// Triggered from the atomic call queued by the probe, which runs ahead of any queued later
+		metrics.actionsStart = monotonicMicros();
+	}
+
+	void IterationEnd()
+	{
+		// Triggered from the atomic call queued by the cull marker, after events, culls and other actions
+		if (!sampleIterations)
+			return;
+
+		if (IsCollecting())
 		{
-			// Triggered from the atomic call
-			metrics.addLoopTime(std::clock());
+			unsigned long long busy = metrics.addIteration(monotonicMicros(), cpuMicros());
+			if (stalls.threshold)
+				stalls.checkIteration(busy);
 		}
+		probe->arm();
 	}
 
 	void StartMetrics(bool restarted = false)
 	{
-		tSock = new TelegrafSocket(this, port);
+		shouldReconnect = false;
+		TelegrafSocket *sock = NULL;
+		if (transportType == "udp")
+			transport = new TelegrafDatagram(host, port, mtu);
+		else if (transportType == "unixgram")
+			transport = new TelegrafDatagram(path, mtu);
+		else
+			transport = sock = new TelegrafSocket(this, host, port, maxSendQ);
 		if (!silent)
 			ServerInstance->SNO->WriteGlobalSno('a', "METRICS: Telegraf metrics %sstarted.", restarted ? "re" : "");
+		if (sock && sock->HasFailed())
+			SocketError(I_ERR_CONNECT);
 	}
 
 	void StopMetrics(bool error = false)
 	{
-		ServerInstance->GlobalCulls.AddItem(tSock);
+		transport->Destroy();
 		if (!silent)
 		{
 			if (!error)
@@ -334,28 +4077,130 @@ class TelegrafModule : public Module
 			else
 			{
 				ServerInstance->SNO->WriteGlobalSno('a', "METRICS: Socket error occurred: %s",
-													tSock->getError().c_str());
+													transport->GetTransportError().c_str());
 			}
 		}
-		tSock = NULL;
-		metrics.clear();
+		transport = NULL;
+		if (!error)
+			metrics.clear();
 	}
 
 	void SocketError(BufferedSocketError e)
 	{
 		StopMetrics(true);
 		if (reconnectTimeout)
-			shouldReconnect = true;
+			ScheduleReconnect();
+		else
+			metrics.clear();
+	}
+
+	/** Flushes if the interval has passed */
+	void CheckFlush()
+	{
+		unsigned long long now = monotonicMicros();
+		// Some slack, so a wakeup that comes a little early doesn't push the flush to the next one
+		if (now + flushInterval * 100 < nextFlush)
+			return;
+		nextFlush += flushInterval * 1000ULL;
+		if (nextFlush <= now)
+			nextFlush = now + flushInterval * 1000ULL;
+		Flush();
+	}
+
+	void Flush()
+	{
+		time_t curtime = ServerInstance->Time();
+		if (shouldReconnect && !transport && curtime >= nextReconnect)
+			StartMetrics(true);
+
+		unsigned int due = schedule.next();
+		if (transport && transport->IsReady())
+		{
+			reconnectAttempts = 0;
+			SendMetrics(due);
+			ReplaySpool();
+		}
+		else if (IsRunning())
+		{
+			SpoolMetrics(due);
+		}
+		else if (exporter || !aggregateTo.empty() || archive.enabled())
+		{
+			EncodeMetrics(due, archive.enabled());
+		}
+
+		if (archive.enabled())
+			archive.append(encoder.str(), curtime);
 	}
 
+	/** Encodes a flush of the given collectors and starts collecting afresh for those.
+	 * The flush always goes to the Prometheus exporter, if any, and to the line encoder if lines is set.
+	 */
+	void EncodeMetrics(unsigned int due, bool lines = true);
+
+	void SendMetrics(unsigned int due);
+
+	/** Keeps a flush for later if the spool is enabled, otherwise drops it */
+	void SpoolMetrics(unsigned int due);
+
+	/** Sends one rate-limited chunk of spooled data */
+	void ReplaySpool();
+
+	/** Writes the metrics of the given collectors, and of everything that is collected on every flush */
+	void GetMetrics(MetricsWriter &out, unsigned int due = CollectorSchedule::ALL);
+
+	void GetCommandMetrics(MetricsWriter &out);
+
+	void GetHookMetrics(MetricsWriter &out);
+
+	void GetRegistrationMetrics(MetricsWriter &out);
+
+	void GetLinkMetrics(MetricsWriter &out);
+
+	/** Reports the counters other modules publish, see the top of this file */
+	void GetModuleMetrics(MetricsWriter &out);
+
+	void ResetModuleHistograms();
+
+	void GetStallMetrics(MetricsWriter &out);
+
+	void GetProcessMetrics(MetricsWriter &out);
+
+	/** Sends this server's summary to the aggregating server, or merges it if this is that server */
+	void SendSummary();
+
+	void GetNetworkMetrics(MetricsWriter &out);
+
+	void GetTopTalkers(MetricsWriter &out, const char *kind, const SpaceSaving<TopTalkers::SLOTS> &counter,
+					   bool users);
+
 	CullResult cull()
 	{
+		// None of the actions are still queued, see QueueAction
 		if (action)
 			ServerInstance->GlobalCulls.AddItem(action);
+		if (iterationAction)
+			ServerInstance->GlobalCulls.AddItem(iterationAction);
+		if (phaseAction)
+			ServerInstance->GlobalCulls.AddItem(phaseAction);
+		if (cullMarker)
+			cullMarker->creator = NULL;
+		if (probe)
+			ServerInstance->GlobalCulls.AddItem(probe);
+		if (layoutAction)
+			ServerInstance->GlobalCulls.AddItem(layoutAction);
+		if (closeAction)
+			ServerInstance->GlobalCulls.AddItem(closeAction);
+		profiler.closer = NULL;
+		profiler.remove();
 		if (timer)
 			ServerInstance->Timers->DelTimer(timer);
-		if (tSock)
+		if (flushTimer)
+			ServerInstance->GlobalCulls.AddItem(flushTimer);
+		if (transport)
 			StopMetrics();
+		delete exporter;
+		exporter = NULL;
 		return Module::cull();
 	}
 
@@ -368,6 +4213,16 @@ class TelegrafModule : public Module
 void LoopLagTimer::Tick(time_t)
 {
 	creator->LoopTick(true);
+	creator->CheckFlush();
+}
+
+void FlushTimer::HandleEvent(EventType et, int errornum)
+{
+	if (et != EVENT_READ)
+		return;
+	uint64_t expirations;
+	if (read(GetFd(), &expirations, sizeof(expirations)) > 0)
+		creator->CheckFlush();
 }
 
 void LoopAction::Call()
@@ -375,6 +4230,39 @@ void LoopAction::Call()
 	creator->LoopTick(false);
 }
 
+void HookLayoutAction::Call()
+{
+	creator->LayoutHooks();
+}
+
+void HookCloseAction::Call()
+{
+	creator->profiler.closeOpen();
+}
+
+void IterationAction::Call()
+{
+	creator->IterationEnd();
+}
+
+void PhaseAction::Call()
+{
+	creator->ActionsStart();
+}
+
+CullResult CullMarker::cull()
+{
+	if (creator)
+		creator->CullsStart();
+	return classbase::cull();
+}
+
+void LoopProbe::HandleEvent(EventType et, int errornum)
+{
+	if (et == EVENT_WRITE)
+		creator->IterationStart();
+}
+
 CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, User *user)
 {
 	if (actions.find(parameters[0]) == actions.end())
@@ -397,7 +4285,11 @@ CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, Us
 	std::string message;
 	if (parameters[0] == "start")
 	{
-		if (!mod->tSock)
+		if (!mod->IsConfigured())
+		{
+			messages.push_back("Telegraf metrics are not configured");
+		}
+		else if (!mod->transport)
 		{
 			mod->StartMetrics();
 			messages.push_back("Telegraf metrics started");
@@ -409,10 +4301,13 @@ CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, Us
 	}
 	else if (parameters[0] == "stop")
 	{
-		if (mod->tSock)
+		if (mod->IsRunning())
 		{
 			mod->shouldReconnect = false;
-			mod->StopMetrics();
+			if (mod->transport)
+				mod->StopMetrics();
+			else
+				mod->metrics.clear();
 			messages.push_back("Telegraf metrics stopped");
 		}
 		else
@@ -422,7 +4317,7 @@ CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, Us
 	}
 	else if (parameters[0] == "restart")
 	{
-		if (mod->tSock)
+		if (mod->transport)
 		{
 			mod->StopMetrics();
 			mod->StartMetrics(true);
@@ -435,32 +4330,49 @@ CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, Us
 	}
 	else if (parameters[0] == "status")
 	{
-		if (mod->tSock)
+		if (mod->transport)
+		{
+			messages.push_back("Telegraf metrics running over " + mod->DescribeTransport());
+			messages.push_back("Lines dropped: " + ConvToStr(mod->transport->dropped + mod->spool.dropped));
+		}
+		else if (mod->shouldReconnect)
 		{
-			messages.push_back("Telegraf metrics running");
+			long wait = std::max(0L, static_cast<long>(mod->nextReconnect - ServerInstance->Time()));
+			messages.push_back("Telegraf metrics waiting to reconnect over " + mod->DescribeTransport() + " in " +
+							   ConvToStr(wait) + "s");
 		}
 		else
 		{
 			messages.push_back("Telegraf metrics not running");
 		}
+		messages.push_back("Flushing every " + ConvToStr(mod->flushInterval) + " ms" +
+						   (mod->flushTimer && mod->flushTimer->GetFd() > -1 ? "" : ", checked once a second"));
+		if (!mod->spool.empty())
+		{
+			messages.push_back("Bytes spooled: " + ConvToStr(mod->spool.size()));
+		}
+		if (mod->archive.enabled())
+		{
+			messages.push_back("Archiving to " + mod->archive.getPath() + ": " + ConvToStr(mod->archive.getSize()) +
+							   " bytes, " + ConvToStr(mod->archive.dropped) + " lines dropped");
+		}
+		if (mod->exporter)
+		{
+			const std::string &error = mod->exporter->GetError();
+			messages.push_back("Prometheus endpoint on " + mod->exporter->description + ": " +
+							   (error.empty() ? ConvToStr(mod->exporter->GetClientCount()) + " connections" : error));
+		}
 	}
 	else if (parameters[0] == "sample")
 	{
-		if (mod->tSock)
+		if (mod->IsCollecting())
 		{
-			TelegrafLine line = mod->tSock->GetMetrics();
-			messages.push_back("Name: " + line.name);
-			messages.push_back("Tags:");
-			for (std::map<std::string, std::string>::const_iterator i = line.tags.begin(); i != line.tags.end(); ++i)
-			{
-				messages.push_back("    " + i->first + "=" + i->second);
-			}
-			messages.push_back("Values:");
-			for (std::map<std::string, std::string>::const_iterator i = line.fields.begin();
-				 i != line.fields.end(); ++i)
-			{
-				messages.push_back("    " + i->first + "=" + i->second);
-			}
+			LineEncoder out;
+			mod->GetMetrics(out);
+			irc::sepstream lines(out.str(), '\n');
+			std::string line;
+			while (lines.GetToken(line))
+				messages.push_back(line);
 			messages.push_back("End of metrics");
 		}
 		else
@@ -468,6 +4380,16 @@ CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, Us
 			messages.push_back("Telegraf metrics don't appear to be running");
 		}
 	}
+	else if (parameters[0] == "stalls")
+	{
+		const StallLog &stalls = mod->stalls;
+		for (unsigned int i = 0; i < stalls.size(); ++i)
+		{
+			const StallEvent &stall = stalls.get(i);
+			messages.push_back(ConvToStr(ServerInstance->Time() - stall.when) + "s ago: " + stall.describe());
+		}
+		messages.push_back("End of stalls (" + ConvToStr(stalls.total()) + " since load)");
+	}
 	else
 	{
 		return CMD_FAILURE;
@@ -486,71 +4408,563 @@ CmdResult TelegrafCommand::Handle(const std::vector<std::string> &parameters, Us
 	return CMD_SUCCESS;
 }
 
+CmdResult TelegrafSummaryCommand::Handle(const std::vector<std::string> &parameters, User *user)
+{
+	// Only ever sent by servers over ENCAP
+	if (IS_LOCAL(user) || !IS_SERVER(user))
+		return CMD_FAILURE;
+
+	TelegrafModule *mod = static_cast<TelegrafModule *>(static_cast<Module *>(creator));
+	if (!mod->IsAggregator())
+		return CMD_FAILURE;
+
+	mod->network.apply(user->server, parameters[0], ServerInstance->Time());
+	return CMD_SUCCESS;
+}
+
 void TelegrafSocket::OnError(BufferedSocketError e)
 {
 	if (creator)
 		creator->SocketError(e);
 }
 
-void TelegrafSocket::SendMetrics()
+void TelegrafModule::EncodeMetrics(unsigned int due, bool lines)
+{
+	bool loop = due & (1 << CollectorSchedule::LOOP);
+	if (loop && !aggregateTo.empty())
+		SendSummary();
+	if ((due & (1 << CollectorSchedule::WHOWAS)) || whowas.stale)
+		whowas.Refresh();
+	if ((due & (1 << CollectorSchedule::PROCESS)) || process.stale)
+		process.Refresh();
+
+	encoder.clear();
+	encoder.setTimestamp(ServerInstance->Time() * 1000000000ULL + ServerInstance->Time_ns());
+	if (exporter)
+	{
+		exporter->encoder.startFlush();
+		if (lines)
+		{
+			MetricsTee both(encoder, exporter->encoder);
+			GetMetrics(both, due);
+		}
+		else
+		{
+			GetMetrics(exporter->encoder, due);
+		}
+		exporter->Publish();
+	}
+	else if (lines)
+	{
+		GetMetrics(encoder, due);
+	}
+
+	if (loop)
+	{
+		metrics.resetLoop();
+		network.reset();
+	}
+	if (due & (1 << CollectorSchedule::COMMANDS))
+		metrics.commands.reset();
+	if (due & (1 << CollectorSchedule::HOOKS))
+		profiler.reset();
+	metrics.registration.reset();
+	ResetModuleHistograms();
+	talkers.reset();
+	stalls.markFlushed();
+	network.expire(ServerInstance->Time(), 60);
+}
+
+void TelegrafModule::SendMetrics(unsigned int due)
 {
 	ServerInstance->Logs->Log("TELEGRAF", DEBUG, "Sending Telegraf Metrics..");
-	TelegrafLine line = GetMetrics();
-	creator->metrics.loopTimes.clear();
-	creator->metrics.loopTimes.reserve(10);
-	std::string out(line.format());
-	WriteData(out);
-	ServerInstance->Logs->Log("TELEGRAF", DEBUG, "Sent Telegraf metrics: %s", out.c_str());
+	EncodeMetrics(due);
+	transport->Send(encoder.str());
+	ServerInstance->Logs->Log("TELEGRAF", DEBUG, "Sent Telegraf metrics: %s", encoder.str().c_str());
+}
+
+void TelegrafModule::SpoolMetrics(unsigned int due)
+{
+	EncodeMetrics(due, spool.enabled() || archive.enabled());
+	if (!spool.enabled())
+		return;
+	spool.push(encoder.str());
+	ServerInstance->Logs->Log("TELEGRAF", DEBUG, "Spooled Telegraf metrics, %llu bytes waiting", spool.size());
+}
+
+void TelegrafModule::ReplaySpool()
+{
+	// Leave the sendq room for the regular flushes, the backlog can wait
+	if (spool.empty() || transport->Room() < replayRate)
+		return;
+
+	std::string chunk;
+	if (spool.pop(chunk, replayRate))
+		transport->Send(chunk);
 }
 
-TelegrafLine TelegrafSocket::GetMetrics()
+void TelegrafModule::GetMetrics(MetricsWriter &out, unsigned int due)
 {
-	TelegrafLine line;
-	line.name = "ircd";
-	line.tags["server"] = ServerInstance->Config->ServerName;
-	line.fields["users"] = ConvToStr(ServerInstance->Users->LocalUserCount());
+	out.begin("ircd");
+	out.tag("server", ServerInstance->Config->ServerName);
+	out.numberField("users", ServerInstance->Users->LocalUserCount());
 	float bits_in, bits_out, bits_total;
 	ServerInstance->SE->GetStats(bits_in, bits_out, bits_total);
-	line.fields["rate_in"] = ConvToStr(bits_in);
-	line.fields["rate_out"] = ConvToStr(bits_out);
-	line.fields["rate_total"] = ConvToStr(bits_total);
-	if (ServerInstance->Config->WhoWasGroupSize && ServerInstance->Config->WhoWasMaxGroups)
+	out.floatField("rate_in", bits_in);
+	out.floatField("rate_out", bits_out);
+	out.floatField("rate_total", bits_total);
+	if (whowas.valid)
 	{
-		Module *whowas = ServerInstance->Modules->Find("cmd_whowas.so");
-		if (whowas)
-		{
-			WhowasRequest req(NULL, whowas, WhowasRequest::WHOWAS_STATS);
-			req.user = ServerInstance->FakeClient;
-			req.Send();
-			// "Whowas entries: <size> (<size> bytes)"
-			std::string stats = req.value;
-			stats.erase(0, 16);
-			// "<size> (<size> bytes)"
-			std::string::size_type pos = stats.find_first_of(' ');
-			// "<size> (<size> bytes)"
-			//        ^
-			line.fields["whowas_size"] = stats.substr(0, pos);
-			stats.erase(0, pos + 2);
-			// "<size> bytes)"
-			pos = stats.find_first_of(' ');
-			// "<size> bytes)"
-			//        ^
-			line.fields["whowas_bytes"] = stats.substr(0, pos);
-		}
-	}
-	line.fields["data_sent"] = ConvToStr(ServerInstance->stats->statsSent);
-	line.fields["data_recv"] = ConvToStr(ServerInstance->stats->statsRecv);
-	line.fields["dns"] = ConvToStr(ServerInstance->stats->statsDns);
-	line.fields["dns_good"] = ConvToStr(ServerInstance->stats->statsDnsGood);
-	line.fields["dns_bad"] = ConvToStr(ServerInstance->stats->statsDnsBad);
-	line.fields["sock_accepts"] = ConvToStr(ServerInstance->stats->statsAccept);
-	line.fields["sock_refused"] = ConvToStr(ServerInstance->stats->statsRefused);
-	line.fields["connects"] = ConvToStr(ServerInstance->stats->statsConnects);
-	line.fields["nick_collisions"] = ConvToStr(ServerInstance->stats->statsCollisions);
-	line.fields["cmd_unknown"] = ConvToStr(ServerInstance->stats->statsUnknown);
-	line.fields["sockets"] = ConvToStr(ServerInstance->SE->GetUsedFds());
-	line.fields["main_loop_time"] = ConvToStr(creator->metrics.getAverageLoopTime());
-	return line;
+		out.numberField("whowas_size", whowas.entries);
+		out.numberField("whowas_bytes", whowas.bytes);
+	}
+	out.floatField("data_sent", ServerInstance->stats->statsSent);
+	out.floatField("data_recv", ServerInstance->stats->statsRecv);
+	out.numberField("dns", ServerInstance->stats->statsDns);
+	out.numberField("dns_good", ServerInstance->stats->statsDnsGood);
+	out.numberField("dns_bad", ServerInstance->stats->statsDnsBad);
+	out.numberField("sock_accepts", ServerInstance->stats->statsAccept);
+	out.numberField("sock_refused", ServerInstance->stats->statsRefused);
+	out.numberField("connects", ServerInstance->stats->statsConnects);
+	out.numberField("nick_collisions", ServerInstance->stats->statsCollisions);
+	out.numberField("cmd_unknown", ServerInstance->stats->statsUnknown);
+	out.numberField("sockets", ServerInstance->SE->GetUsedFds());
+	out.numberField("metrics_dropped", (transport ? transport->dropped : 0) + spool.dropped);
+	out.numberField("metrics_spooled", spool.size());
+	out.numberField("stalls", stalls.total());
+	if (due & (1 << CollectorSchedule::LOOP))
+	{
+		const LatencyHistogram &loop = metrics.loopTimes;
+		// main_loop_time has always been CPU time, the percentiles below are wall clock time
+		out.numberField("main_loop_time", metrics.loopCpuTimes.getMean());
+		out.numberField("main_loop_wall_time", loop.getMean());
+		out.numberField("main_loop_count", loop.getCount());
+		out.numberField("main_loop_p50", loop.percentile(0.50));
+		out.numberField("main_loop_p90", loop.percentile(0.90));
+		out.numberField("main_loop_p99", loop.percentile(0.99));
+		out.numberField("main_loop_p999", loop.percentile(0.999));
+		out.numberField("main_loop_max", loop.getMax());
+		if (sampleIterations)
+		{
+			const LatencyHistogram &wall = metrics.iterationWall;
+			const LatencyHistogram &cpu = metrics.iterationCpu;
+			out.numberField("main_loop_iterations", wall.getCount());
+			out.numberField("main_loop_wall_p50", wall.percentile(0.50));
+			out.numberField("main_loop_wall_p99", wall.percentile(0.99));
+			out.numberField("main_loop_wall_max", wall.getMax());
+			out.numberField("main_loop_cpu_p50", cpu.percentile(0.50));
+			out.numberField("main_loop_cpu_p99", cpu.percentile(0.99));
+			out.numberField("main_loop_cpu_max", cpu.getMax());
+			out.numberField("main_loop_timers_total", metrics.timersTime.getTotal());
+			out.numberField("main_loop_timers_max", metrics.timersTime.getMax());
+			out.numberField("main_loop_dispatch_total", metrics.dispatchTime.getTotal());
+			out.numberField("main_loop_dispatch_max", metrics.dispatchTime.getMax());
+			out.numberField("main_loop_dispatch_cpu_total", metrics.dispatchCpu.getTotal());
+			out.numberField("main_loop_dispatch_cpu_max", metrics.dispatchCpu.getMax());
+			out.numberField("main_loop_culls_total", metrics.cullsTime.getTotal());
+			out.numberField("main_loop_culls_max", metrics.cullsTime.getMax());
+			out.numberField("main_loop_actions_total", metrics.actionsTime.getTotal());
+			out.numberField("main_loop_actions_max", metrics.actionsTime.getMax());
+			out.numberField("main_loop_events", metrics.socketEvents.getTotal());
+			out.numberField("main_loop_events_max", metrics.socketEvents.getMax());
+		}
+	}
+	out.end();
+	if (commandStats && (due & (1 << CollectorSchedule::COMMANDS)))
+		GetCommandMetrics(out);
+	if (profileHooks && (due & (1 << CollectorSchedule::HOOKS)))
+		GetHookMetrics(out);
+	GetRegistrationMetrics(out);
+	GetLinkMetrics(out);
+	GetModuleMetrics(out);
+	GetProcessMetrics(out);
+	if (IsAggregator() && (due & (1 << CollectorSchedule::LOOP)))
+		GetNetworkMetrics(out);
+	if (reportTalkers)
+	{
+		GetTopTalkers(out, "channel_messages", talkers.channelMessages, false);
+		GetTopTalkers(out, "channel_fanout", talkers.channelFanout, false);
+		GetTopTalkers(out, "user_messages", talkers.userMessages, true);
+	}
+	GetStallMetrics(out);
+}
+
+void TelegrafModule::GetCommandMetrics(MetricsWriter &out)
+{
+	const CommandStats &commands = metrics.commands;
+	for (unsigned int i = 0; i < commands.size(); ++i)
+	{
+		const CommandStats::Entry &entry = commands[i];
+		if (!entry.latency.getCount())
+			continue;
+
+		out.begin("ircd_command");
+		out.tag("command", commands.name(i));
+		out.tag("server", ServerInstance->Config->ServerName);
+		out.intField("count", entry.latency.getCount());
+		out.intField("time_total", entry.total);
+		out.intField("time_max", entry.latency.getMax());
+		out.intField("time_p50", entry.latency.percentile(0.50));
+		out.intField("time_p90", entry.latency.percentile(0.90));
+		out.intField("time_p99", entry.latency.percentile(0.99));
+		out.end();
+	}
+}
+
+void TelegrafModule::GetHookMetrics(MetricsWriter &out)
+{
+	for (unsigned int module = 0; module < HookProfiler::MAX_MODULES; ++module)
+	{
+		for (unsigned int event = 0; event < PROFILED_EVENT_COUNT; ++event)
+		{
+			const HookProfiler::Entry &entry = profiler.get(module, event);
+			if (!entry.count)
+				continue;
+
+			out.begin("ircd_module_hook");
+			out.tag("event", profiled_event_names[event]);
+			out.tag("module", profiler.name(module));
+			out.tag("server", ServerInstance->Config->ServerName);
+			out.intField("count", entry.count);
+			out.intField("time_total", entry.total);
+			out.intField("time_max", entry.max);
+			out.end();
+		}
+	}
+}
+
+void TelegrafModule::GetRegistrationMetrics(MetricsWriter &out)
+{
+	const RegistrationStats &registration = metrics.registration;
+	for (unsigned int stage = 0; stage < RegistrationStats::STAGE_COUNT; ++stage)
+	{
+		const LatencyHistogram &latency = registration.stages[stage];
+		if (!latency.getCount() && !registration.skipped[stage]
+			&& (stage != RegistrationStats::STAGE_REGISTERED || !registration.aborted))
+			continue;
+
+		out.begin("ircd_registration");
+		out.tag("stage", RegistrationStats::name(stage));
+		out.tag("server", ServerInstance->Config->ServerName);
+		out.intField("count", latency.getCount());
+		out.intField("time_p50", latency.percentile(0.50));
+		out.intField("time_p90", latency.percentile(0.90));
+		out.intField("time_p99", latency.percentile(0.99));
+		out.intField("time_max", latency.getMax());
+		if (stage != RegistrationStats::STAGE_REGISTERED)
+			out.intField("skipped", registration.skipped[stage]);
+		else
+			out.intField("aborted", registration.aborted);
+		out.end();
+	}
+}
+
+void TelegrafModule::GetLinkMetrics(MetricsWriter &out)
+{
+	ProtoServerList servers;
+	ServerInstance->PI->GetServerList(servers);
+	links.expire(servers);
+	const std::string &us = ServerInstance->Config->ServerName;
+	for (ProtoServerList::const_iterator i = servers.begin(); i != servers.end(); ++i)
+	{
+		if (i->servername == us)
+			continue;
+
+		out.begin("ircd_link");
+		out.tag("peer", i->servername);
+		out.tag("server", us);
+		out.boolField("direct", i->parentname == us);
+		out.intField("users", i->usercount);
+		out.intField("opers", i->opercount);
+		out.intField("rtt_ms", i->latencyms);
+		const LinkTracker::Link *link = links.find(i->servername);
+		if (link)
+		{
+			if (link->socket)
+				out.intField("sendq", links.sendq(*link));
+			if (link->burstTime)
+			{
+				out.intField("burst_time", link->burstTime);
+				out.intField("burst_users", link->burstUsers);
+				out.intField("burst_channels", link->burstChannels);
+				out.intField("burst_bytes", link->burstBytes);
+			}
+			if (link->receivedBurstTime)
+				out.intField("burst_received_ms", link->receivedBurstTime);
+		}
+		out.end();
+	}
+}
+
+/* The metrics another module publishes, see the top of this file */
+struct TelegrafMetric
+{
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+	const char *name;
+	int type;
+	long long value;
+	unsigned long long *buckets;
+};
+
+struct TelegrafMetrics
+{
+	enum { MAGIC = 0x54474d53, VERSION = 1, BUCKETS = 64 };
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	TelegrafMetric *metrics;
+};
+
+/** The view m_telegraf has of a "telegraf/" data service. It is never created here, the publishing
+ * modules declare their own class with a TelegrafMetrics as its first member.
+ */
+class ModuleMetrics : public DataProvider
+{
+ public:
+	TelegrafMetrics telegraf;
+};
+
+/** Returns the metrics a data service publishes, or NULL if it doesn't publish any */
+static TelegrafMetrics *publishedMetrics(ServiceProvider *service)
+{
+	// Services named "x/telegraf" are listed under "telegraf" as well
+	if (service->name.compare(0, 9, "telegraf/"))
+		return NULL;
+	TelegrafMetrics &published = static_cast<ModuleMetrics *>(service)->telegraf;
+	if (published.magic != TelegrafMetrics::MAGIC || published.version != TelegrafMetrics::VERSION)
+		return NULL;
+	return &published;
+}
+
+/** Returns the upper bound of the bucket the given quantile falls in, see TelegrafMetric::HISTOGRAM */
+static unsigned long long bucketPercentile(const unsigned long long *buckets, unsigned long long count, double q)
+{
+	unsigned long long target = static_cast<unsigned long long>(q * count + 0.5);
+	if (target < 1)
+		target = 1;
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < TelegrafMetrics::BUCKETS - 1; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= target)
+			return (1ULL << i) - 1;
+	}
+	return (1ULL << (TelegrafMetrics::BUCKETS - 1)) - 1;
+}
+
+void TelegrafModule::GetModuleMetrics(MetricsWriter &out)
+{
+	typedef std::multimap<std::string, ServiceProvider *>::const_iterator ProviderIter;
+	std::pair<ProviderIter, ProviderIter> range = ServerInstance->Modules->DataProviders.equal_range("telegraf");
+	std::string measurement;
+	std::string key;
+	for (ProviderIter i = range.first; i != range.second; ++i)
+	{
+		const TelegrafMetrics *published = publishedMetrics(i->second);
+		if (!published || !published->count)
+			continue;
+
+		measurement = "ircd_" + i->second->name.substr(9);
+		out.begin(measurement.c_str());
+		out.tag("server", ServerInstance->Config->ServerName);
+		for (unsigned int m = 0; m < published->count; ++m)
+		{
+			const TelegrafMetric &metric = published->metrics[m];
+			if (metric.type == TelegrafMetric::COUNTER || metric.type == TelegrafMetric::GAUGE)
+			{
+				out.intField(metric.name, metric.value);
+			}
+			else if (metric.type == TelegrafMetric::HISTOGRAM && metric.buckets)
+			{
+				unsigned long long count = 0;
+				for (unsigned int b = 0; b < TelegrafMetrics::BUCKETS; ++b)
+					count += metric.buckets[b];
+				key.assign(metric.name).append("_count");
+				out.intField(key.c_str(), count);
+				if (!count)
+					continue;
+				key.assign(metric.name).append("_p50");
+				out.intField(key.c_str(), bucketPercentile(metric.buckets, count, 0.50));
+				key.assign(metric.name).append("_p99");
+				out.intField(key.c_str(), bucketPercentile(metric.buckets, count, 0.99));
+			}
+		}
+		out.end();
+	}
+}
+
+void TelegrafModule::ResetModuleHistograms()
+{
+	typedef std::multimap<std::string, ServiceProvider *>::const_iterator ProviderIter;
+	std::pair<ProviderIter, ProviderIter> range = ServerInstance->Modules->DataProviders.equal_range("telegraf");
+	for (ProviderIter i = range.first; i != range.second; ++i)
+	{
+		TelegrafMetrics *published = publishedMetrics(i->second);
+		for (unsigned int m = 0; published && m < published->count; ++m)
+		{
+			TelegrafMetric &metric = published->metrics[m];
+			if (metric.type == TelegrafMetric::HISTOGRAM && metric.buckets)
+				memset(metric.buckets, 0, TelegrafMetrics::BUCKETS * sizeof(*metric.buckets));
+		}
+	}
+}
+
+void TelegrafModule::GetProcessMetrics(MetricsWriter &out)
+{
+	if (!process.valid)
+		return;
+
+	out.begin("ircd_process");
+	out.tag("server", ServerInstance->Config->ServerName);
+	out.intField("cpu_user", process.cpuUser);
+	out.intField("cpu_system", process.cpuSystem);
+	out.intField("ctx_voluntary", process.contextVoluntary);
+	out.intField("ctx_involuntary", process.contextInvoluntary);
+	out.intField("faults_major", process.faultsMajor);
+	out.intField("faults_minor", process.faultsMinor);
+	if (process.hasStatus)
+	{
+		out.intField("rss", process.rss);
+		out.intField("vsz", process.virtualSize);
+	}
+	out.intField("rss_peak", process.rssPeak);
+	if (process.hasHeap)
+	{
+		out.intField("heap_arena", process.heapArena);
+		out.intField("heap_mmap", process.heapMapped);
+		out.intField("heap_in_use", process.heapInUse);
+		out.intField("heap_free", process.heapFree);
+		out.intField("heap_releasable", process.heapReleasable);
+	}
+	out.end();
+}
+
+void TelegrafModule::GetTopTalkers(MetricsWriter &out, const char *kind,
+								   const SpaceSaving<TopTalkers::SLOTS> &counter, bool users)
+{
+	unsigned int slots[TopTalkers::MAX_REPORTED];
+	unsigned int count = counter.top(reportTalkers, slots);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		// Ranks rather than names are tagged, so the number of series stays fixed
+		out.begin("ircd_top");
+		out.tag("kind", kind);
+		out.tag("rank", ConvToStr(i + 1));
+		out.tag("server", ServerInstance->Config->ServerName);
+		const std::string &key = counter.key(slots[i]);
+		User *user = users ? ServerInstance->FindUUID(key) : NULL;
+		out.stringField("name", user ? user->GetFullHost() : key);
+		out.intField("count", counter.count(slots[i]));
+		out.intField("error", counter.error(slots[i]));
+		out.end();
+	}
+}
+
+void TelegrafModule::SendSummary()
+{
+	unsigned long long gauges[SUMMARY_GAUGES];
+	float bits_in, bits_out, bits_total;
+	ServerInstance->SE->GetStats(bits_in, bits_out, bits_total);
+	gauges[0] = ServerInstance->Users->LocalUserCount();
+	gauges[1] = ServerInstance->SE->GetUsedFds();
+	gauges[2] = static_cast<unsigned long long>(bits_in);
+	gauges[3] = static_cast<unsigned long long>(bits_out);
+	// The per-command counts reset on their own collector's schedule, so send what was added since the last summary
+	gauges[4] = metrics.commands.finished - summaryCommands;
+	summaryCommands = metrics.commands.finished;
+	gauges[5] = stalls.total();
+	const LatencyHistogram *histograms[SUMMARY_HISTOGRAMS] = {&metrics.loopTimes, &metrics.iterationWall};
+
+	// Leave room for the prefix, ENCAP, the target and the command name
+	std::vector<std::string> messages;
+	NetworkAggregator::encode(gauges, histograms, messages, 400);
+	for (std::vector<std::string>::iterator i = messages.begin(); i != messages.end(); ++i)
+	{
+		if (IsAggregator())
+		{
+			network.apply(ServerInstance->Config->ServerName, *i, ServerInstance->Time());
+			continue;
+		}
+		parameterlist params;
+		params.push_back(aggregateTo);
+		params.push_back("TELEGRAFSUM");
+		params.push_back(":" + *i);
+		ServerInstance->PI->SendEncapsulatedData(params);
+	}
+}
+
+void TelegrafModule::GetNetworkMetrics(MetricsWriter &out)
+{
+	unsigned long long totals[SUMMARY_GAUGES] = {0};
+	LatencyHistogram merged[SUMMARY_HISTOGRAMS];
+	const std::map<std::string, ServerSummary *> &servers = network.get();
+	for (std::map<std::string, ServerSummary *>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+	{
+		const ServerSummary &summary = *i->second;
+		out.begin("ircd_network_server");
+		out.tag("server", i->first);
+		for (unsigned int g = 0; g < SUMMARY_GAUGES; ++g)
+		{
+			out.intField(summary_gauges[g], summary.gauges[g]);
+			totals[g] += summary.gauges[g];
+		}
+		out.intField("main_loop_p99", summary.histograms[0].percentile(0.99));
+		out.intField("main_loop_max", summary.histograms[0].getMax());
+		out.end();
+
+		for (unsigned int h = 0; h < SUMMARY_HISTOGRAMS; ++h)
+		{
+			const LatencyHistogram &hist = summary.histograms[h];
+			for (unsigned int b = 0; b < LatencyHistogram::BUCKETS; ++b)
+			{
+				if (hist.getBucket(b))
+					merged[h].mergeBucket(b, hist.getBucket(b));
+			}
+			merged[h].mergeTotals(hist.getCount(), hist.getTotal(), hist.getMax());
+		}
+	}
+
+	out.begin("ircd_network");
+	out.tag("server", ServerInstance->Config->ServerName);
+	out.intField("servers", servers.size());
+	for (unsigned int g = 0; g < SUMMARY_GAUGES; ++g)
+		out.intField(summary_gauges[g], totals[g]);
+	for (unsigned int h = 0; h < SUMMARY_HISTOGRAMS; ++h)
+	{
+		const LatencyHistogram &hist = merged[h];
+		if (!hist.getCount())
+			continue;
+		std::string prefix = std::string(summary_histograms[h]) + "_";
+		out.intField((prefix + "count").c_str(), hist.getCount());
+		out.intField((prefix + "p50").c_str(), hist.percentile(0.50));
+		out.intField((prefix + "p99").c_str(), hist.percentile(0.99));
+		out.intField((prefix + "max").c_str(), hist.getMax());
+	}
+	out.end();
+}
+
+void TelegrafModule::GetStallMetrics(MetricsWriter &out)
+{
+	for (unsigned int i = stalls.unflushed(); i-- > 0;)
+	{
+		const StallEvent &stall = stalls.get(i);
+		out.beginEvent("ircd_stall", stall.at);
+		out.tag("kind", stall.kind);
+		out.tag("server", ServerInstance->Config->ServerName);
+		out.intField("duration", stall.duration);
+		out.intField("occurred", stall.when);
+		if (!stall.command.empty())
+			out.stringField("command", stall.command);
+		if (!stall.source.empty())
+			out.stringField("source", stall.source);
+		if (!stall.module.empty())
+			out.stringField("module", stall.module);
+		if (!stall.event.empty())
+			out.stringField("event", stall.event);
+		out.end();
+	}
 }
 
 MODULE_INIT(TelegrafModule)
@@ -76,13 +76,57 @@ class CommandScore : public Command
 	}
 };
 
+/* Reported as ircd_userscore, see the top of m_telegraf.cpp */
+struct TelegrafMetric
+{
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+	const char *name;
+	int type;
+	long long value;
+	unsigned long long *buckets;
+};
+
+struct TelegrafMetrics
+{
+	enum { MAGIC = 0x54474d53, VERSION = 1, BUCKETS = 64 };
+
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	TelegrafMetric *metrics;
+};
+
+class UserScoreMetrics : public DataProvider
+{
+ public:
+	TelegrafMetrics telegraf;
+	/* s: bans and exceptions that matched, for joins, messages and nick changes alike */
+	TelegrafMetric banMatches;
+
+	UserScoreMetrics(Module* Creator)
+		: DataProvider(Creator, "telegraf/userscore")
+	{
+		banMatches.name = "ban_matches";
+		banMatches.type = TelegrafMetric::COUNTER;
+		banMatches.value = 0;
+		banMatches.buckets = NULL;
+		telegraf.magic = TelegrafMetrics::MAGIC;
+		telegraf.version = TelegrafMetrics::VERSION;
+		telegraf.count = 1;
+		telegraf.metrics = &banMatches;
+	}
+};
+
 class ModuleUserScore : public Module
 {
 	CommandScore cmd;
+	UserScoreMetrics metrics;
 
  public:
 	ModuleUserScore()
 		: cmd(this)
+		, metrics(this)
 	{
 	}
 
@@ -90,6 +134,7 @@ class ModuleUserScore : public Module
 	{
 		ServerInstance->Modules->AddService(cmd);
 		ServerInstance->Modules->AddService(cmd.ext);
+		ServerInstance->Modules->AddService(metrics);
 		Implementation eventlist[] = { I_OnWhois, I_On005Numeric, I_OnCheckBan };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
@@ -111,6 +156,7 @@ class ModuleUserScore : public Module
 		if (cmd.ext.get(user) < required_score)
 		{
 			// user->WriteNumeric(609, "%s %s :You cannot join because your user score is too low", user->nick.c_str(), chan->name.c_str());
+			metrics.banMatches.value++;
 			return MOD_RES_DENY;
 		}
 
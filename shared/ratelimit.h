@@ -0,0 +1,377 @@
+/** A limit of some number of lines or bytes every secs seconds, as set by a channel mode */
+class ratelimit
+{
+ public:
+	unsigned int limit;
+	unsigned int secs;
+
+	ratelimit(unsigned int Limit, unsigned int Secs) : limit(Limit), secs(Secs)
+	{
+	}
+
+	/** The window things are counted over, in milliseconds */
+	unsigned long long span() const
+	{
+		return secs * 1000ULL;
+	}
+
+	/** Reads a mode parameter of the form <limit>:<secs>, returning false if it isn't valid */
+	bool parse(const std::string &str)
+	{
+		std::string::size_type colon = str.find(':');
+		if ((colon == std::string::npos) || (str.find('-') != std::string::npos))
+			return false;
+
+		limit = ConvToInt(str.substr(0, colon));
+		secs = ConvToInt(str.substr(colon + 1));
+		return ((limit >= 2) && (secs >= 1));
+	}
+
+	std::string str() const
+	{
+		return ConvToStr(limit) + ":" + ConvToStr(secs);
+	}
+
+	/** The current time in milliseconds */
+	static unsigned long long now()
+	{
+		return ServerInstance->Time() * 1000ULL + ServerInstance->Time_ns() / 1000000;
+	}
+};
+
+/* Window policies for ratelimiter. Each keeps a state per key and a clock shared by every key of
+ * a limiter, and provides:
+ *	start(clock, now, rate)               once, when the limiter is made
+ *	advance(clock, now, rate)             before every count
+ *	add(state, clock, now, rate, amount)  counts amount, returns true if the key is now at the limit
+ *	idle(state, clock, now, rate)         whether the state no longer matters and can be forgotten
+ * A new state is default constructed. Times are in milliseconds, see ratelimit::now().
+ */
+
+/** Counts in windows of secs shared by every key, the first starting with the limiter.
+ *
+ * A window ends once the second it was due to end in is over. Counts from before the current
+ * window are left in place and read as zero, rather than clearing every count when it ends.
+ */
+struct fixedwindow
+{
+	struct clock
+	{
+		unsigned long epoch;
+		/* The second the current window ends with */
+		unsigned long long reset;
+	};
+
+	struct state
+	{
+		unsigned long epoch;
+		unsigned long long count;
+
+		state() : epoch(0), count(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		c.epoch = 0;
+		c.reset = now / 1000 + rate.secs;
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		if (now / 1000 > c.reset)
+		{
+			c.epoch++;
+			c.reset = now / 1000 + rate.secs;
+		}
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		if (s.epoch != c.epoch)
+		{
+			s.epoch = c.epoch;
+			s.count = 0;
+		}
+		s.count += amount;
+		return (s.count >= rate.limit);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		return (s.epoch != c.epoch);
+	}
+};
+
+/** Counts in windows of secs that start with the first count rather than on a shared boundary.
+ *
+ * The count for the last secs is estimated from the current window plus the part of the previous
+ * window that still overlaps it, so a burst across a window boundary still counts.
+ */
+struct slidingwindow
+{
+	struct clock
+	{
+	};
+
+	struct state
+	{
+		/* Start of the current window */
+		unsigned long long start;
+		unsigned long long current;
+		unsigned long long previous;
+
+		state() : start(0), current(0), previous(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		unsigned long long span = rate.span();
+		if (idle(s, c, now, rate))
+		{
+			s.start = now;
+			s.current = s.previous = 0;
+		}
+		else if (now - s.start >= span)
+		{
+			s.start += span;
+			s.previous = s.current;
+			s.current = 0;
+		}
+		s.current += amount;
+
+		/* The previous window's count is taken to be spread evenly over it. The overlap leaves
+		 * out its first millisecond, which is no longer in the last span, so users who speak on a
+		 * timer at just under the limit don't trip it at every window boundary. */
+		unsigned long long overlap = span - (now - s.start) - 1;
+		return (s.previous * overlap / span + s.current >= rate.limit);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		return (now - s.start >= 2 * rate.span());
+	}
+};
+
+/** Lets limit through at once, then limit more every secs as the bucket drains.
+ *
+ * Each line or byte adds span to the level, which drains by limit every millisecond, so the key
+ * is at the limit once the level reaches limit * span. What is counted beyond that is dropped
+ * rather than kept as debt, so a key that stops is let through again within secs.
+ */
+struct tokenbucket
+{
+	struct clock
+	{
+		/* limit * span, or as much as fits */
+		unsigned long long full;
+		/* Longest time that can be multiplied by limit without overflowing */
+		unsigned long long longest;
+	};
+
+	struct state
+	{
+		unsigned long long level;
+		unsigned long long last;
+
+		state() : level(0), last(0)
+		{
+		}
+	};
+
+	static void start(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		unsigned long long most = ~0ULL;
+		unsigned long long span = rate.span();
+		c.full = (rate.limit && span > most / rate.limit) ? most : rate.limit * span;
+		c.longest = rate.limit ? most / rate.limit : most;
+	}
+
+	static void advance(clock &c, unsigned long long now, const ratelimit &rate)
+	{
+	}
+
+	static bool add(state &s, const clock &c, unsigned long long now, const ratelimit &rate, unsigned long long amount)
+	{
+		unsigned long long elapsed = now - s.last;
+		if (s.level)
+		{
+			if (elapsed > c.longest || elapsed * rate.limit >= s.level)
+				s.level = 0;
+			else
+				s.level -= elapsed * rate.limit;
+		}
+		s.last = now;
+
+		unsigned long long cost = amount * rate.span();
+		s.level = (cost >= c.full - s.level) ? c.full : s.level + cost;
+		return (s.level >= c.full);
+	}
+
+	static bool idle(const state &s, const clock &c, unsigned long long now, const ratelimit &rate)
+	{
+		unsigned long long elapsed = now - s.last;
+		return (elapsed > c.longest || elapsed * rate.limit >= s.level);
+	}
+};
+
+/* Scope policies for ratelimiter, which decide what a count belongs to */
+
+/** Counts each local user on their own, forgetting idle users a couple at a time as counts come in */
+struct peruser
+{
+	template<typename Window>
+	class keys
+	{
+		UserTable<typename Window::state> states;
+		/* Slot of states that idle users are checked for from */
+		unsigned int cursor;
+
+	 public:
+		keys() : cursor(0)
+		{
+		}
+
+		typename Window::state &get(User *who)
+		{
+			return states.get(who);
+		}
+
+		void forget(User *who)
+		{
+			states.erase(who);
+		}
+
+		unsigned int size() const
+		{
+			return states.size();
+		}
+
+		void expire(const typename Window::clock &c, unsigned long long now, const ratelimit &rate)
+		{
+			for (unsigned int i = 0; i < 2 && states.size(); ++i)
+			{
+				if (cursor >= states.capacity())
+					cursor = 0;
+				typename Window::state *s = states.at(cursor);
+				// Erasing can move the next entry into this slot, so it is looked at again
+				if (s && Window::idle(*s, c, now, rate))
+					states.eraseAt(cursor);
+				else
+					++cursor;
+			}
+		}
+	};
+};
+
+/** Counts everything in the channel together */
+struct perchannel
+{
+	template<typename Window>
+	class keys
+	{
+		typename Window::state state;
+
+	 public:
+		typename Window::state &get(User *who)
+		{
+			return state;
+		}
+
+		void forget(User *who)
+		{
+		}
+
+		unsigned int size() const
+		{
+			return 1;
+		}
+
+		void expire(const typename Window::clock &c, unsigned long long now, const ratelimit &rate)
+		{
+		}
+	};
+};
+
+/* Measure policies for ratelimiter, which decide how much a message counts for */
+
+struct countlines
+{
+	static unsigned long long amount(const std::string &text)
+	{
+		return 1;
+	}
+};
+
+struct countbytes
+{
+	static unsigned long long amount(const std::string &text)
+	{
+		return text.length();
+	}
+};
+
+/** Limits what is said in a channel, with the policies picked at compile time so that each mode
+ * only pays for what it uses: fixedwindow, slidingwindow or tokenbucket; peruser or perchannel;
+ * countlines or countbytes.
+ */
+template<typename Window, typename Scope, typename Measure>
+class ratelimiter : public ratelimit
+{
+	typename Window::clock clock;
+	typename Scope::template keys<Window> keys;
+
+	bool count(User *who, unsigned long long amount)
+	{
+		unsigned long long t = now();
+		Window::advance(clock, t, *this);
+		keys.expire(clock, t, *this);
+		return Window::add(keys.get(who), clock, t, *this, amount);
+	}
+
+ public:
+	ratelimiter(const ratelimit &rate) : ratelimit(rate)
+	{
+		Window::start(clock, now(), *this);
+	}
+
+	/** Counts a message, returning true if that brings its sender, or the channel, to the limit */
+	bool add(User *who, const std::string &text)
+	{
+		return count(who, Measure::amount(text));
+	}
+
+	/** Counts lines or bytes sent somewhere else, e.g. on another server */
+	void addamount(User *who, unsigned long long amount)
+	{
+		count(who, amount);
+	}
+
+	/** Returns true if the sender, or the channel, is at the limit already */
+	bool full(User *who)
+	{
+		return count(who, 0);
+	}
+
+	void forget(User *who)
+	{
+		keys.forget(who);
+	}
+
+	/** Number of counts kept, for one channel */
+	unsigned int size() const
+	{
+		return keys.size();
+	}
+};
@@ -0,0 +1,165 @@
+/** An open-addressing hash table from local users to a small value, keyed by UUID.
+ *
+ * Entries live in a single array and are found by linear probing, so a lookup touches a cache
+ * line or two instead of walking a tree of heap nodes. Keys are UUIDs rather than User pointers,
+ * which a new user may get after the old one quits. The table never holds more than MAX_ENTRIES;
+ * once full, adding a user evicts another one, so memory stays bounded during join floods.
+ */
+template<typename Value>
+class UserTable
+{
+ public:
+	static const unsigned int MAX_ENTRIES = 4096;
+
+ private:
+	struct Slot
+	{
+		uint32_t hash;
+		/* Empty if the first character is 0 */
+		char uuid[UUID_LENGTH];
+		Value value;
+	};
+
+	std::vector<Slot> slots;
+	unsigned int count;
+	/* Where to look for an entry to evict when the table is full */
+	unsigned int victim;
+
+	static uint32_t hashOf(const std::string &uuid)
+	{
+		uint32_t h = 2166136261U;
+		for (std::string::const_iterator i = uuid.begin(); i != uuid.end(); ++i)
+			h = (h ^ static_cast<unsigned char>(*i)) * 16777619U;
+		return h;
+	}
+
+	unsigned int mask() const
+	{
+		return slots.size() - 1;
+	}
+
+	/** Returns the slot holding the user, or the empty slot where they would go */
+	unsigned int probe(const std::string &uuid, uint32_t h) const
+	{
+		unsigned int i = h & mask();
+		while (slots[i].uuid[0] && (slots[i].hash != h || uuid.compare(slots[i].uuid)))
+			i = (i + 1) & mask();
+		return i;
+	}
+
+	void resize(unsigned int size)
+	{
+		std::vector<Slot> old(size);
+		old.swap(slots);
+		for (unsigned int i = 0; i < slots.size(); ++i)
+			slots[i].uuid[0] = 0;
+		for (typename std::vector<Slot>::const_iterator i = old.begin(); i != old.end(); ++i)
+		{
+			if (!i->uuid[0])
+				continue;
+			unsigned int j = i->hash & mask();
+			while (slots[j].uuid[0])
+				j = (j + 1) & mask();
+			slots[j] = *i;
+		}
+		victim = 0;
+	}
+
+ public:
+	UserTable() : count(0), victim(0)
+	{
+	}
+
+	Value *find(User *user)
+	{
+		if (!count)
+			return NULL;
+		unsigned int i = probe(user->uuid, hashOf(user->uuid));
+		return slots[i].uuid[0] ? &slots[i].value : NULL;
+	}
+
+	/** Returns the user's entry, adding a default-constructed one if there is none.
+	 * The reference is only good until the table is next changed.
+	 */
+	Value &get(User *user)
+	{
+		uint32_t h = hashOf(user->uuid);
+		if (count)
+		{
+			unsigned int i = probe(user->uuid, h);
+			if (slots[i].uuid[0])
+				return slots[i].value;
+		}
+
+		// Keep the table at most half full
+		if (count >= MAX_ENTRIES)
+		{
+			while (!slots[victim & mask()].uuid[0])
+				victim++;
+			eraseAt(victim++ & mask());
+		}
+		else if ((count + 1) * 2 > slots.size())
+		{
+			resize(std::max<unsigned int>(slots.size() * 2, 16));
+		}
+
+		unsigned int i = probe(user->uuid, h);
+		slots[i].hash = h;
+		user->uuid.copy(slots[i].uuid, UUID_LENGTH - 1);
+		slots[i].uuid[std::min<size_t>(user->uuid.size(), UUID_LENGTH - 1)] = 0;
+		slots[i].value = Value();
+		count++;
+		return slots[i].value;
+	}
+
+	void erase(User *user)
+	{
+		if (!count)
+			return;
+		unsigned int i = probe(user->uuid, hashOf(user->uuid));
+		if (slots[i].uuid[0])
+			eraseAt(i);
+	}
+
+	/** Empties a slot, moving later entries of the same probe run back so lookups need no tombstones */
+	void eraseAt(unsigned int slot)
+	{
+		unsigned int hole = slot;
+		for (unsigned int i = (slot + 1) & mask(); slots[i].uuid[0]; i = (i + 1) & mask())
+		{
+			// An entry can only move back if its home slot isn't between the hole and where it is now
+			unsigned int home = slots[i].hash & mask();
+			if (((i - home) & mask()) >= ((i - hole) & mask()))
+			{
+				slots[hole] = slots[i];
+				hole = i;
+			}
+		}
+		slots[hole].uuid[0] = 0;
+		count--;
+	}
+
+	void clear()
+	{
+		slots.clear();
+		count = 0;
+		victim = 0;
+	}
+
+	unsigned int size() const
+	{
+		return count;
+	}
+
+	/** Number of slots, for walking the table with at() */
+	unsigned int capacity() const
+	{
+		return slots.size();
+	}
+
+	/** Returns the entry in a slot, or NULL if the slot is empty */
+	Value *at(unsigned int slot)
+	{
+		return slots[slot].uuid[0] ? &slots[slot].value : NULL;
+	}
+};
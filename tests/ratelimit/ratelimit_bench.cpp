@@ -0,0 +1,95 @@
+/*
+ * Times one message through each rate limiting policy in shared/ratelimit.h, for a busy channel
+ * with many talkers and with a few.
+ */
+
+#include <cstdio>
+#include <map>
+
+#include "stub.h"
+
+InspIRCd *ServerInstance;
+
+static unsigned long long nanos()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** How +x and +U counted before the rate limiting policies, one map node per talker */
+class mapcounter : public ratelimit
+{
+	std::map<User *, unsigned int> counters;
+	time_t reset;
+
+ public:
+	mapcounter(const ratelimit &rate) : ratelimit(rate), reset(ServerInstance->Time() + rate.secs)
+	{
+	}
+
+	bool add(User *who, const std::string &text)
+	{
+		if (ServerInstance->Time() > reset)
+		{
+			counters.clear();
+			reset = ServerInstance->Time() + secs;
+		}
+		return (++counters[who] >= limit);
+	}
+};
+
+static const unsigned int MESSAGES = 2000000;
+static volatile unsigned long long sink;
+
+template<typename Limiter>
+static void run(const char *name, const std::vector<User *> &users)
+{
+	Limiter limiter(ratelimit(20, 10));
+	const std::string text = "a line of chat about the size of a typical message";
+	unsigned long long limited = 0;
+	unsigned long long start = nanos();
+	for (unsigned int i = 0; i < MESSAGES; ++i)
+	{
+		// Step the clock a millisecond every few messages, a few hundred messages a second
+		if (!(i & 3))
+			ServerInstance->advance(1);
+		limited += limiter.add(users[(i * 2654435761U) % users.size()], text);
+	}
+	unsigned long long elapsed = nanos() - start;
+	sink = limited;
+	printf("%-44s %5u talkers %7.1f ns/message\n", name, static_cast<unsigned int>(users.size()),
+		   static_cast<double>(elapsed) / MESSAGES);
+}
+
+static void runAll(unsigned int talkers)
+{
+	std::vector<User *> users;
+	for (unsigned int i = 0; i < talkers; ++i)
+	{
+		users.push_back(new User);
+		users.back()->uuid = "000AAA" + ConvToStr(1000 + i).substr(1);
+	}
+
+	run<mapcounter>("std::map<User*> counters (before)", users);
+	run<ratelimiter<fixedwindow, peruser, countlines> >("fixedwindow peruser countlines (+U)", users);
+	run<ratelimiter<slidingwindow, peruser, countlines> >("slidingwindow peruser countlines (+x)", users);
+	run<ratelimiter<tokenbucket, peruser, countlines> >("tokenbucket peruser countlines", users);
+	run<ratelimiter<slidingwindow, peruser, countbytes> >("slidingwindow peruser countbytes", users);
+	run<ratelimiter<fixedwindow, perchannel, countlines> >("fixedwindow perchannel countlines", users);
+	run<ratelimiter<slidingwindow, perchannel, countlines> >("slidingwindow perchannel countlines (+x net)", users);
+	run<ratelimiter<tokenbucket, perchannel, countbytes> >("tokenbucket perchannel countbytes", users);
+
+	for (unsigned int i = 0; i < talkers; ++i)
+		delete users[i];
+}
+
+int main()
+{
+	InspIRCd server;
+	ServerInstance = &server;
+
+	runAll(8);
+	runAll(1000);
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Checks the policies in shared/ratelimit.h, including that +x and +U still limit exactly as they
+ * did before they shared it.
+ */
+
+#include <cstdio>
+
+#include "stub.h"
+
+InspIRCd *ServerInstance;
+
+static unsigned int failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static User *makeUser(unsigned int n)
+{
+	User *user = new User;
+	user->uuid = "000AAA" + ConvToStr(100 + n % 900);
+	return user;
+}
+
+/** +U as it was, with its own map of counts */
+class baselineslowmode
+{
+ public:
+	unsigned int secs;
+	unsigned int lines;
+	time_t reset;
+	unsigned long epoch;
+	std::vector<std::pair<unsigned long, unsigned int> > counts;
+
+	baselineslowmode(unsigned int Secs, unsigned int Lines, unsigned int users)
+		: secs(Secs), lines(Lines), epoch(0), counts(users)
+	{
+		reset = ServerInstance->Time() + secs;
+	}
+
+	bool addmessage(unsigned int who)
+	{
+		if (ServerInstance->Time() > reset)
+		{
+			epoch++;
+			reset = ServerInstance->Time() + secs;
+		}
+		std::pair<unsigned long, unsigned int> &count = counts[who];
+		if (count.first != epoch)
+		{
+			count.first = epoch;
+			count.second = 0;
+		}
+		return (++count.second >= lines);
+	}
+};
+
+/** +x's per-user limit as it was */
+class baselineglobalflood
+{
+	struct window
+	{
+		unsigned long long start;
+		unsigned long long current;
+		unsigned long long previous;
+	};
+
+	std::vector<window> windows;
+
+ public:
+	unsigned int limit;
+	unsigned long long span;
+
+	baselineglobalflood(unsigned int Limit, unsigned int secs, unsigned int users)
+		: windows(users), limit(Limit), span(secs * 1000ULL)
+	{
+		for (unsigned int i = 0; i < users; ++i)
+			windows[i].start = windows[i].current = windows[i].previous = 0;
+	}
+
+	bool add(unsigned int who)
+	{
+		unsigned long long now = ratelimit::now();
+		window &w = windows[who];
+		if (now - w.start >= 2 * span)
+		{
+			w.start = now;
+			w.current = w.previous = 0;
+		}
+		else if (now - w.start >= span)
+		{
+			w.start += span;
+			w.previous = w.current;
+			w.current = 0;
+		}
+		w.current++;
+		unsigned long long overlap = span - (now - w.start) - 1;
+		return (w.previous * overlap / span + w.current >= limit);
+	}
+};
+
+static void testParse()
+{
+	ratelimit rate(0, 0);
+	CHECK(rate.parse("5:10") && rate.limit == 5 && rate.secs == 10 && rate.str() == "5:10");
+	CHECK(rate.parse("3:5:7") && rate.str() == "3:5");
+	CHECK(!rate.parse("1:10"));
+	CHECK(!rate.parse("5:0"));
+	CHECK(!rate.parse("-5:10"));
+	CHECK(!rate.parse("5-10"));
+	CHECK(!rate.parse("510"));
+}
+
+/** Feeds the same messages to the old and new +U and +x and compares every decision */
+static void testMatchesBaseline()
+{
+	const unsigned int USERS = 50;
+	std::vector<User *> users;
+	for (unsigned int i = 0; i < USERS; ++i)
+		users.push_back(makeUser(i));
+
+	srand(1);
+	for (unsigned int round = 0; round < 20; ++round)
+	{
+		unsigned int limit = 2 + rand() % 8;
+		unsigned int secs = 1 + rand() % 10;
+		baselineslowmode oldslow(secs, limit, USERS);
+		ratelimiter<fixedwindow, peruser, countlines> slow(ratelimit(limit, secs));
+		baselineglobalflood oldflood(limit, secs, USERS);
+		ratelimiter<slidingwindow, peruser, countlines> flood(ratelimit(limit, secs));
+
+		unsigned int mismatches = 0;
+		for (unsigned int i = 0; i < 20000; ++i)
+		{
+			unsigned int who = rand() % USERS;
+			ServerInstance->advance(rand() % 200);
+			if (oldslow.addmessage(who) != slow.add(users[who], "hello"))
+				mismatches++;
+			if (oldflood.add(who) != flood.add(users[who], "hello"))
+				mismatches++;
+		}
+		CHECK(mismatches == 0);
+	}
+
+	for (unsigned int i = 0; i < USERS; ++i)
+		delete users[i];
+}
+
+static void testTokenBucket()
+{
+	User *user = makeUser(1);
+	ratelimiter<tokenbucket, peruser, countlines> bucket(ratelimit(5, 10));
+
+	// A burst of four passes and the fifth line reaches the limit
+	for (unsigned int i = 0; i < 4; ++i)
+		CHECK(!bucket.add(user, "x"));
+	CHECK(bucket.add(user, "x"));
+
+	// It drains by one line every secs / limit
+	ServerInstance->advance(2000);
+	CHECK(bucket.add(user, "x"));
+	ServerInstance->advance(4000);
+	CHECK(!bucket.add(user, "x"));
+
+	// Lines past the limit aren't held against the user once they stop
+	for (unsigned int i = 0; i < 100; ++i)
+		bucket.add(user, "x");
+	ServerInstance->advance(10000);
+	CHECK(!bucket.add(user, "x"));
+
+	// Limits too large to multiply out don't wrap around
+	ratelimiter<tokenbucket, peruser, countlines> huge(ratelimit(4000000000U, 4000000000U));
+	CHECK(!huge.add(user, "x"));
+	ServerInstance->advance(1);
+	CHECK(!huge.add(user, "x"));
+	delete user;
+}
+
+static void testScopesAndMeasures()
+{
+	User *first = makeUser(1);
+	User *second = makeUser(2);
+
+	ratelimiter<slidingwindow, perchannel, countlines> channel(ratelimit(3, 10));
+	CHECK(!channel.add(first, "x"));
+	CHECK(!channel.add(second, "x"));
+	CHECK(channel.add(first, "x"));
+	CHECK(channel.full(NULL));
+	channel.addamount(NULL, 0);
+	ServerInstance->advance(20000);
+	CHECK(!channel.full(NULL));
+
+	ratelimiter<fixedwindow, peruser, countbytes> bytes(ratelimit(10, 5));
+	CHECK(!bytes.add(first, "12345"));
+	CHECK(!bytes.add(second, "12345"));
+	CHECK(bytes.add(first, "12345"));
+
+	// A forgotten user starts from nothing
+	bytes.forget(first);
+	CHECK(!bytes.add(first, "12345"));
+
+	delete first;
+	delete second;
+}
+
+static void testExpiry()
+{
+	ratelimiter<slidingwindow, peruser, countlines> flood(ratelimit(5, 1));
+	std::vector<User *> users;
+	for (unsigned int i = 0; i < 100; ++i)
+	{
+		users.push_back(makeUser(i));
+		flood.add(users.back(), "x");
+	}
+
+	CHECK(flood.size() == 100);
+
+	// Once everyone is idle, each message forgets a couple of them
+	ServerInstance->advance(3000);
+	for (unsigned int i = 0; i < 200; ++i)
+		flood.add(users[0], "x");
+	CHECK(flood.size() == 1);
+
+	// Leaving forgets a user at once
+	flood.forget(users[0]);
+	CHECK(flood.size() == 0);
+
+	ratelimiter<fixedwindow, peruser, countlines> slow(ratelimit(5, 1));
+	for (unsigned int i = 0; i < users.size(); ++i)
+		slow.add(users[i], "x");
+	ServerInstance->advance(3000);
+	for (unsigned int i = 0; i < 200; ++i)
+		slow.add(users[0], "x");
+	CHECK(slow.size() == 1);
+
+	for (unsigned int i = 0; i < users.size(); ++i)
+		delete users[i];
+}
+
+int main()
+{
+	InspIRCd server;
+	ServerInstance = &server;
+
+	testParse();
+	testMatchesBaseline();
+	testTokenBucket();
+	testScopesAndMeasures();
+	testExpiry();
+
+	if (failures)
+	{
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Just enough of InspIRCd 2.0 to build the code in shared/ on its own, with a clock the tests set.
+ */
+
+#ifndef RATELIMIT_STUB_H
+#define RATELIMIT_STUB_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#define UUID_LENGTH 10
+
+class User
+{
+ public:
+	std::string uuid;
+};
+
+class InspIRCd
+{
+ public:
+	time_t now;
+	long now_ns;
+
+	InspIRCd() : now(1000000), now_ns(0)
+	{
+	}
+
+	time_t Time()
+	{
+		return now;
+	}
+
+	long Time_ns()
+	{
+		return now_ns;
+	}
+
+	/** Moves the clock forward by ms milliseconds */
+	void advance(unsigned long long ms)
+	{
+		unsigned long long total = now_ns / 1000000 + ms;
+		now += total / 1000;
+		now_ns = (total % 1000) * 1000000;
+	}
+};
+
+extern InspIRCd *ServerInstance;
+
+inline int ConvToInt(const std::string &in)
+{
+	return atoi(in.c_str());
+}
+
+template<typename T>
+inline std::string ConvToStr(const T &in)
+{
+	std::ostringstream out;
+	out << in;
+	return out.str();
+}
+
+#include "../../shared/usertable.h"
+#include "../../shared/ratelimit.h"
+
+#endif
@@ -0,0 +1,387 @@
+#!/usr/bin/env python3
+"""A stand-in for Telegraf's socket_listener input, for testing m_telegraf without a real collector.
+
+Every line received is checked against the InfluxDB line protocol, strictly enough that an
+escaping mistake shows up as a malformed line rather than a silently mangled value. It can also
+misbehave the ways a real collector does:
+
+	normal  read everything as it arrives
+	slow    read at most rate bytes a second
+	stall   accept connections but read nothing until resume() is called
+	reset   reset each connection once reset_after lines have been read from it
+	refuse  don't listen at all, so connections are refused, until listen() is called
+
+Run it directly to print what m_telegraf sends:
+
+	./fake_telegraf.py --transport tcp --port 8094 --behaviour slow --rate 1024
+"""
+
+import argparse
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+
+
+class LineError(ValueError):
+	pass
+
+
+def _read(line, pos, stops):
+	"""Reads up to the first unescaped character in stops. A backslash only escapes the characters
+	in stops and itself, anywhere else it is kept as it is."""
+	out = []
+	while pos < len(line) and line[pos] not in stops:
+		if line[pos] == '\\' and pos + 1 < len(line) and line[pos + 1] in stops + '\\':
+			pos += 1
+		out.append(line[pos])
+		pos += 1
+	return ''.join(out), pos
+
+
+def _read_string(line, pos):
+	"""Reads a string field value starting just after its opening quote"""
+	out = []
+	while pos < len(line) and line[pos] != '"':
+		if line[pos] == '\\' and pos + 1 < len(line) and line[pos + 1] in '"\\':
+			pos += 1
+		out.append(line[pos])
+		pos += 1
+	if pos >= len(line):
+		raise LineError('unterminated string field')
+	return ''.join(out), pos + 1
+
+
+_INTEGER = re.compile(r'(-?\d+)i|(\d+)u')
+_FLOAT = re.compile(r'[-+]?(?:\d+\.?\d*|\.\d+)(?:[eE][-+]?\d+)?')
+_BOOLEAN = re.compile(r'(t|T|true|True|TRUE)|(f|F|false|False|FALSE)')
+_TIMESTAMP = re.compile(r'-?\d+')
+
+
+def _read_value(line, pos):
+	for pattern in (_INTEGER, _BOOLEAN, _FLOAT):
+		match = pattern.match(line, pos)
+		if match and (match.end() == len(line) or line[match.end()] in ', '):
+			break
+	else:
+		raise LineError('bad field value at %d' % pos)
+	if pattern is _INTEGER:
+		value = int(match.group(1) or match.group(2))
+	elif pattern is _BOOLEAN:
+		value = bool(match.group(1))
+	else:
+		value = float(match.group(0))
+	return value, match.end()
+
+
+def parse_line(line):
+	"""Parses one line of line protocol into (measurement, tags, fields, timestamp), with escapes
+	undone and field values converted. Raises LineError for anything Telegraf would reject."""
+	measurement, pos = _read(line, 0, ', ')
+	if not measurement:
+		raise LineError('missing measurement')
+
+	tags = {}
+	while line.startswith(',', pos):
+		key, pos = _read(line, pos + 1, ',= ')
+		if not key or not line.startswith('=', pos):
+			raise LineError('bad tag key at %d' % pos)
+		value, pos = _read(line, pos + 1, ',= ')
+		if not value:
+			raise LineError('empty tag value for %s' % key)
+		tags[key] = value
+
+	if not line.startswith(' ', pos):
+		raise LineError('no fields')
+	fields = {}
+	while True:
+		key, pos = _read(line, pos + 1, ',= ')
+		if not key or not line.startswith('=', pos):
+			raise LineError('bad field key at %d' % pos)
+		if line.startswith('"', pos + 1):
+			value, pos = _read_string(line, pos + 2)
+		else:
+			value, pos = _read_value(line, pos + 1)
+		if key in fields:
+			raise LineError('duplicate field %s' % key)
+		fields[key] = value
+		if not line.startswith(',', pos):
+			break
+
+	timestamp = None
+	if pos < len(line):
+		if not line.startswith(' ', pos) or not _TIMESTAMP.fullmatch(line, pos + 1):
+			raise LineError('bad timestamp at %d' % pos)
+		timestamp = int(line[pos + 1:])
+	return measurement, tags, fields, timestamp
+
+
+class Line(object):
+	"""A line as received: when, on which connection (0 for datagrams), and what it said"""
+
+	def __init__(self, received, connection, raw, parsed):
+		self.received = received
+		self.connection = connection
+		self.size = len(raw) + 1
+		self.measurement, self.tags, self.fields, self.timestamp = parsed
+
+	@property
+	def time(self):
+		"""When the line was collected, in seconds since the epoch"""
+		return self.timestamp / 1e9 if self.timestamp is not None else None
+
+
+def free_port(transport='tcp'):
+	"""Returns a local port that nothing is listening on right now"""
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM if transport == 'udp' else socket.SOCK_STREAM)
+	sock.bind(('127.0.0.1', 0))
+	port = sock.getsockname()[1]
+	sock.close()
+	return port
+
+
+class FakeTelegraf(object):
+	def __init__(self, transport='tcp', port=0, behaviour='normal', rate=4096, reset_after=1, rcvbuf=None):
+		self.transport = transport
+		self.port = port or free_port(transport)
+		self.behaviour = behaviour
+		self.rate = rate
+		self.reset_after = reset_after
+		self.rcvbuf = rcvbuf
+		self.cond = threading.Condition()
+		# Everything below is guarded by cond
+		self.lines = []
+		self.errors = []
+		self.connections = []
+		self.closed = []
+		self.datagrams = []
+		self.peers = {}
+		self.sockets = {}
+		self.listener = None
+		self.stopped = False
+		if behaviour != 'refuse':
+			self.listen()
+
+	def listen(self):
+		"""Starts listening, which is also how a refusing listener comes back"""
+		kind = socket.SOCK_DGRAM if self.transport == 'udp' else socket.SOCK_STREAM
+		listener = socket.socket(socket.AF_INET, kind)
+		listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		if self.rcvbuf:
+			# Accepted sockets inherit this, it has to be set before the handshake to shrink the window
+			listener.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, self.rcvbuf)
+		listener.bind(('127.0.0.1', self.port))
+		listener.settimeout(0.1)
+		with self.cond:
+			if self.behaviour == 'refuse':
+				self.behaviour = 'normal'
+			self.listener = listener
+		if self.transport == 'udp':
+			self._spawn(self._receive, listener)
+		else:
+			listener.listen(5)
+			self._spawn(self._accept, listener)
+
+	def refuse(self):
+		"""Stops listening and resets every open connection, so reconnects are refused"""
+		with self.cond:
+			self.behaviour = 'refuse'
+			listener, self.listener = self.listener, None
+			sockets = list(self.sockets.values())
+		if listener:
+			# Shutting down stops a listening socket at once, a close waits for the accept thread
+			try:
+				listener.shutdown(socket.SHUT_RDWR)
+			except OSError:
+				pass
+			listener.close()
+		for sock in sockets:
+			self._reset(sock)
+
+	def set_behaviour(self, behaviour):
+		with self.cond:
+			self.behaviour = behaviour
+
+	def stall(self):
+		self.set_behaviour('stall')
+
+	def resume(self):
+		self.set_behaviour('normal')
+
+	def close(self):
+		with self.cond:
+			self.stopped = True
+		self.refuse()
+
+	def wait_for(self, predicate, timeout):
+		"""Waits for predicate(self) to hold, returning whether it did"""
+		deadline = time.time() + timeout
+		with self.cond:
+			while not predicate(self):
+				left = deadline - time.time()
+				if left <= 0:
+					return False
+				self.cond.wait(left)
+			return True
+
+	def measurement(self, name):
+		with self.cond:
+			return [line for line in self.lines if line.measurement == name]
+
+	def kernel_backlog(self, connection):
+		"""Bytes the kernel holds between the ircd and us on a tcp connection: the ircd's socket
+		send queue plus our receive queue. Linux only, read from /proc/net/tcp."""
+		with self.cond:
+			peer = self.peers[connection]
+		backlog = 0
+		with open('/proc/net/tcp') as table:
+			next(table)
+			for row in table:
+				parts = row.split()
+				local, remote = int(parts[1].split(':')[1], 16), int(parts[2].split(':')[1], 16)
+				tx, rx = [int(n, 16) for n in parts[4].split(':')]
+				if (local, remote) == (peer, self.port):
+					backlog += tx
+				elif (local, remote) == (self.port, peer):
+					backlog += rx
+		return backlog
+
+	def _spawn(self, target, *args):
+		thread = threading.Thread(target=target, args=args)
+		thread.daemon = True
+		thread.start()
+
+	def _reset(self, sock):
+		try:
+			sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+			sock.close()
+		except OSError:
+			pass
+
+	def _record(self, raw, connection):
+		now = time.time()
+		try:
+			text = raw.decode('utf-8')
+			line = Line(now, connection, text, parse_line(text))
+		except (UnicodeDecodeError, LineError) as e:
+			with self.cond:
+				self.errors.append((now, raw, str(e)))
+				self.cond.notify_all()
+			return
+		with self.cond:
+			self.lines.append(line)
+			self.cond.notify_all()
+
+	def _accept(self, listener):
+		while True:
+			with self.cond:
+				if self.listener is not listener:
+					return
+			try:
+				sock, addr = listener.accept()
+			except socket.timeout:
+				continue
+			except OSError:
+				return
+			with self.cond:
+				self.connections.append(time.time())
+				number = len(self.connections)
+				self.peers[number] = addr[1]
+				self.sockets[number] = sock
+				self.cond.notify_all()
+			self._spawn(self._read_stream, sock, number)
+
+	def _read_stream(self, sock, number):
+		sock.settimeout(0.1)
+		pending = b''
+		count = 0
+		clean = False
+		while True:
+			with self.cond:
+				behaviour = self.behaviour
+				if self.stopped or self.sockets.get(number) is not sock:
+					break
+			if behaviour == 'stall':
+				time.sleep(0.05)
+				continue
+			try:
+				data = sock.recv(max(1, self.rate // 10) if behaviour == 'slow' else 65536)
+			except socket.timeout:
+				continue
+			except OSError:
+				break
+			if not data:
+				clean = True
+				break
+			lines = (pending + data).split(b'\n')
+			pending = lines.pop()
+			for raw in lines:
+				self._record(raw, number)
+			count += len(lines)
+			with self.cond:
+				behaviour = self.behaviour
+			if behaviour == 'reset' and count >= self.reset_after:
+				self._reset(sock)
+				break
+			if behaviour == 'slow':
+				time.sleep(0.1)
+		with self.cond:
+			# The ircd only ever writes whole lines, so closing with part of one is an error. Our own
+			# resets cut lines short, those partial lines are expected.
+			if clean and pending:
+				self.errors.append((time.time(), pending, 'connection closed mid-line'))
+			self.sockets.pop(number, None)
+			self.closed.append(time.time())
+			self.cond.notify_all()
+		sock.close()
+
+	def _receive(self, listener):
+		while True:
+			with self.cond:
+				if self.listener is not listener:
+					return
+			try:
+				data = listener.recv(65536)
+			except socket.timeout:
+				continue
+			except OSError:
+				return
+			with self.cond:
+				self.datagrams.append((time.time(), len(data), data.count(b'\n')))
+				if not data.endswith(b'\n'):
+					self.errors.append((time.time(), data, 'datagram ends mid-line'))
+			for raw in data.split(b'\n')[:-1]:
+				self._record(raw, 0)
+
+
+def main():
+	parser = argparse.ArgumentParser(description='Fake Telegraf socket_listener for m_telegraf')
+	parser.add_argument('--transport', choices=('tcp', 'udp'), default='tcp')
+	parser.add_argument('--port', type=int, default=8094)
+	parser.add_argument('--behaviour', choices=('normal', 'slow', 'stall', 'reset', 'refuse'), default='normal')
+	parser.add_argument('--rate', type=int, default=4096, help='bytes a second to read when slow')
+	parser.add_argument('--reset-after', type=int, default=1, help='lines to read before resetting')
+	args = parser.parse_args()
+
+	fake = FakeTelegraf(args.transport, args.port, args.behaviour, args.rate, args.reset_after)
+	seen = [0, 0, 0]
+	try:
+		while True:
+			fake.wait_for(lambda f: (len(f.lines), len(f.errors), len(f.connections)) != tuple(seen), 1)
+			with fake.cond:
+				for line in fake.lines[seen[0]:]:
+					print('%d %s %r %r %s' % (line.connection, line.measurement, line.tags, line.fields, line.timestamp))
+				for error in fake.errors[seen[1]:]:
+					print('ERROR %s: %r' % (error[2], error[1]), file=sys.stderr)
+				for _ in fake.connections[seen[2]:]:
+					print('connection %d' % len(fake.connections), file=sys.stderr)
+				seen[:] = [len(fake.lines), len(fake.errors), len(fake.connections)]
+			sys.stdout.flush()
+	except KeyboardInterrupt:
+		fake.close()
+
+
+if __name__ == '__main__':
+	main()
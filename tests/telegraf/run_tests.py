@@ -0,0 +1,421 @@
+#!/usr/bin/env python3
+"""Runs m_telegraf against fake_telegraf.py and checks what reaches the collector.
+
+Needs a built InspIRCd 2.0 with m_telegraf.so in its modules directory, and Linux, for the
+sub-second flush interval and /proc/net/tcp. Each test starts its own ircd on a free port.
+
+	INSPIRCD=~/inspircd/run/bin/inspircd ./run_tests.py [-v] [TestName.test_name]
+"""
+
+import os
+import queue
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+from fake_telegraf import FakeTelegraf, free_port
+
+INSPIRCD = os.environ.get('INSPIRCD', 'inspircd')
+
+# Flushes every FLUSH seconds, the shortest interval m_telegraf allows
+FLUSH = 0.25
+
+# The ircd counts as blocked once it takes this long to answer. Busy or shared machines can
+# hold it up for a second or more without anything being wrong.
+BLOCKED = 5.0
+
+CONFIG = '''
+<server name="harness.test" description="m_telegraf harness" network="Harness">
+<admin name="Harness" nick="harness" email="harness@harness.test">
+<bind address="127.0.0.1" port="{ircport}" type="clients">
+<pid file="{dir}/inspircd.pid">
+<log method="file" type="* -USERINPUT -USEROUTPUT" level="default" target="{dir}/ircd.log">
+<performance nouserdns="yes">
+<channels users="100" opers="100">
+<connect allow="127.0.0.1" timeout="60" pingfreq="120" sendq="4M" recvq="64K" threshold="1000000"
+	commandrate="1000000" fakelag="off" localmax="10" globalmax="10" maxchans="100">
+<class name="Harness" commands="*" privs="*" usermodes="*" chanmodes="*" snomasks="*">
+<type name="Harness" classes="Harness">
+<oper name="harness" password="harness" host="*@*" type="Harness">
+<module name="m_telegraf.so">
+<telegraf {telegraf}>
+'''
+
+
+class InspIRCd(object):
+	"""An ircd with m_telegraf loaded and the given <telegraf> attributes"""
+
+	def __init__(self, **telegraf):
+		self.dir = tempfile.mkdtemp(prefix='telegraf-harness-')
+		self.port = free_port()
+		attrs = ' '.join('%s="%s"' % item for item in sorted(telegraf.items()))
+		config = os.path.join(self.dir, 'inspircd.conf')
+		with open(config, 'w') as f:
+			f.write(CONFIG.format(ircport=self.port, dir=self.dir, telegraf=attrs))
+		args = [INSPIRCD, '--nofork', '--config', config]
+		if os.geteuid() == 0:
+			args.append('--runasroot')
+		self.output = open(os.path.join(self.dir, 'stdout.log'), 'w')
+		self.process = subprocess.Popen(args, cwd=self.dir, stdout=self.output, stderr=subprocess.STDOUT)
+		deadline = time.time() + 10
+		while True:
+			try:
+				socket.create_connection(('127.0.0.1', self.port), 1).close()
+				break
+			except OSError:
+				if self.process.poll() is not None or time.time() > deadline:
+					raise RuntimeError('ircd did not start:\n' + self.log())
+				time.sleep(0.1)
+
+	def alive(self):
+		return self.process.poll() is None
+
+	def log(self):
+		text = ''
+		for name in ('stdout.log', 'ircd.log'):
+			path = os.path.join(self.dir, name)
+			if os.path.exists(path):
+				with open(path, errors='replace') as f:
+					text += f.read()[-4000:]
+		return text
+
+	def stop(self):
+		if self.alive():
+			self.process.terminate()
+			try:
+				self.process.wait(10)
+			except subprocess.TimeoutExpired:
+				self.process.kill()
+				self.process.wait()
+		self.output.close()
+		shutil.rmtree(self.dir, ignore_errors=True)
+
+
+class Client(object):
+	"""A minimal IRC client that records every line it receives with the time it came in"""
+
+	def __init__(self, port, nick):
+		self.nick = nick
+		self.sock = socket.create_connection(('127.0.0.1', port))
+		self.lines = queue.Queue()
+		self.snotices = []
+		self.lock = threading.Lock()
+		thread = threading.Thread(target=self._read)
+		thread.daemon = True
+		thread.start()
+		self.send('NICK %s' % nick)
+		self.send('USER harness 0 * :m_telegraf harness')
+		self.expect(r'^:\S+ 001 ')
+
+	def send(self, line):
+		with self.lock:
+			self.sock.sendall((line + '\r\n').encode('utf-8'))
+
+	def _read(self):
+		pending = b''
+		while True:
+			try:
+				data = self.sock.recv(65536)
+			except OSError:
+				return
+			if not data:
+				return
+			lines = (pending + data).split(b'\r\n')
+			pending = lines.pop()
+			for raw in lines:
+				line = raw.decode('utf-8', 'replace')
+				snotice = re.match(r':\S+ NOTICE \S+ :\*\*\* \S+: METRICS: (.*)', line)
+				if line.startswith('PING '):
+					self.send('PONG ' + line[5:])
+				elif snotice:
+					self.snotices.append((time.time(), snotice.group(1)))
+				else:
+					self.lines.put((time.time(), line))
+
+	def expect(self, pattern, timeout=10):
+		"""Returns the next line matching pattern, skipping any before it"""
+		deadline = time.time() + timeout
+		while True:
+			try:
+				received, line = self.lines.get(timeout=max(0, deadline - time.time()))
+			except queue.Empty:
+				raise AssertionError('no line matching %r' % pattern)
+			match = re.search(pattern, line)
+			if match:
+				return match
+
+	def ping(self):
+		"""Returns how long the ircd takes to answer a PING"""
+		token = 'harness%f' % time.time()
+		start = time.time()
+		self.send('PING :' + token)
+		self.expect(r'PONG .*' + re.escape(token))
+		return time.time() - start
+
+	def oper(self):
+		self.send('OPER harness harness')
+		self.expect(r'^:\S+ 381 ')
+		self.send('MODE %s +s +a' % self.nick)
+		self.ping()
+
+	def telegraf(self, action):
+		"""Returns the notices sent back for a TELEGRAF command"""
+		self.send('TELEGRAF ' + action)
+		token = 'telegraf%f' % time.time()
+		self.send('PING :' + token)
+		notices = []
+		while True:
+			received, line = self.lines.get(timeout=10)
+			if token in line:
+				return notices
+			match = re.search(r' NOTICE \S+ :\*\*\* (.*)', line)
+			if match:
+				notices.append(match.group(1))
+
+	def close(self):
+		self.sock.close()
+
+
+class Chatter(object):
+	"""Keeps a client talking in a set of channels, so each flush has a full set of ircd_top lines"""
+
+	def __init__(self, client, channels, per_second=200):
+		self.client = client
+		self.channels = channels
+		self.delay = 1.0 / per_second
+		self.running = True
+		for channel in channels:
+			client.send('JOIN ' + channel)
+		client.ping()
+		self.thread = threading.Thread(target=self._run)
+		self.thread.daemon = True
+		self.thread.start()
+
+	def _run(self):
+		sent = 0
+		while self.running:
+			self.client.send('PRIVMSG %s :chatter %d' % (self.channels[sent % len(self.channels)], sent))
+			sent += 1
+			time.sleep(self.delay)
+
+	def stop(self):
+		self.running = False
+		self.thread.join()
+
+
+class TelegrafTest(unittest.TestCase):
+	def start(self, fake, **telegraf):
+		"""Starts an ircd sending to fake, with any <telegraf> attributes overridden"""
+		self.fake = fake
+		self.addCleanup(fake.close)
+		attrs = {'interval': '%dms' % (FLUSH * 1000), 'transport': fake.transport, 'host': '127.0.0.1',
+				 'port': fake.port, 'reconnect': 2, 'maxreconnect': 8}
+		attrs.update(telegraf)
+		self.ircd = InspIRCd(**attrs)
+		self.addCleanup(self.ircd.stop)
+
+	def client(self, nick='harness', oper=True):
+		client = Client(self.ircd.port, nick)
+		self.addCleanup(client.close)
+		if oper:
+			client.oper()
+		return client
+
+	def chatter(self, client, channels=40):
+		chatter = Chatter(client, ['#chatter%d' % i for i in range(channels)])
+		self.addCleanup(chatter.stop)
+		return chatter
+
+	def tearDown(self):
+		# Cleanups run after this, while the ircd is still up to be checked
+		if not hasattr(self, 'ircd'):
+			return
+		self.assertTrue(self.ircd.alive(), 'ircd exited with %s:\n%s' % (self.ircd.process.returncode, self.ircd.log()))
+		self.assertEqual(self.fake.errors, [], 'malformed data reached the collector')
+
+	def wait_for(self, predicate, timeout, message):
+		self.assertTrue(self.fake.wait_for(predicate, timeout), message)
+
+	def wait_for_flushes(self, count, timeout=10, since=0):
+		self.wait_for(lambda f: len([l for l in f.lines if l.measurement == 'ircd' and l.received > since]) >= count,
+					  timeout, 'fewer than %d flushes arrived' % count)
+
+
+class Escaping(TelegrafTest):
+	# Channel names may hold anything but spaces, commas and BEL, nicks may hold backslashes
+	CHANNELS = ['#quote"d', '#back\\slash', '#trailing\\', '#both\\"\\\\"=']
+
+	def test_string_fields_round_trip(self):
+		self.start(FakeTelegraf(), toptalkers=len(self.CHANNELS))
+		client = self.client('esc\\ape', oper=False)
+		for channel in self.CHANNELS:
+			client.send('JOIN ' + channel)
+		client.ping()
+
+		def talked(fake):
+			names = set(l.fields['name'] for l in fake.lines
+						if l.measurement == 'ircd_top' and l.tags['kind'] == 'channel_messages')
+			return names >= set(self.CHANNELS)
+
+		# Talker counts start over every flush, so keep talking until a flush has them all
+		deadline = time.time() + 10
+		while not talked(self.fake) and time.time() < deadline:
+			for channel in self.CHANNELS:
+				client.send('PRIVMSG %s :hello' % channel)
+			self.fake.wait_for(talked, FLUSH)
+		self.assertTrue(talked(self.fake), 'channel names did not survive escaping: %r' %
+						sorted(set(l.fields['name'] for l in self.fake.measurement('ircd_top'))))
+
+		users = [l.fields['name'] for l in self.fake.measurement('ircd_top') if l.tags['kind'] == 'user_messages']
+		self.assertTrue(any(name.startswith('esc\\ape!') for name in users), users)
+
+
+class Reconnect(TelegrafTest):
+	def test_backoff_while_refused(self):
+		self.start(FakeTelegraf(), spoolsize=1048576)
+		client = self.client()
+		self.wait_for(lambda f: f.connections, 5, 'never connected')
+		self.wait_for_flushes(2)
+
+		# Each attempt is refused straight away, so every error snotice marks one attempt
+		outage = time.time()
+		self.fake.refuse()
+		delays = [2, 4, 8, 8]
+		deadline = time.time() + 2 * sum(delays) + 20
+		while len([s for s in client.snotices if s[0] >= outage and 'Socket error' in s[1]]) <= len(delays):
+			self.assertLess(time.time(), deadline, 'reconnects stopped: %r' % client.snotices)
+			time.sleep(0.1)
+		errors = [s[0] for s in client.snotices if s[0] >= outage and 'Socket error' in s[1]]
+
+		# The wait is jittered down to half and checked in whole seconds, and a loaded machine can
+		# add seconds more, so only check that the waits back off and stay near maxreconnect
+		gaps = [errors[attempt + 1] - errors[attempt] for attempt in range(len(delays))]
+		for attempt, delay in enumerate(delays):
+			self.assertGreaterEqual(gaps[attempt], delay / 4.0, 'attempt %d came too soon: %r' % (attempt + 1, gaps))
+			self.assertLessEqual(gaps[attempt], 2 * delay + BLOCKED, 'attempt %d came too late: %r' % (attempt + 1, gaps))
+		# Two waits at maxreconnect take at least 6s, two at the first delay at most 4s
+		self.assertGreater(gaps[-2] + gaps[-1], 5, 'waits did not grow: %r' % gaps)
+
+		back = time.time()
+		self.fake.listen()
+		self.wait_for(lambda f: len(f.connections) >= 2, 2 * delays[-1] + BLOCKED, 'did not reconnect once listening again')
+
+		# Flushes made while refused were spooled and are replayed on the new connection
+		self.wait_for(lambda f: [l for l in f.lines if l.connection == 2 and l.measurement == 'ircd' and
+								 outage + 1 < l.time < back], 10, 'spooled flushes were not replayed')
+
+	def test_reset_connections(self):
+		self.start(FakeTelegraf(behaviour='reset', reset_after=5), maxreconnect=64)
+		self.wait_for(lambda f: len(f.connections) >= 6, 60, 'did not keep reconnecting after resets')
+
+		# A connection that took flushes resets the backoff, so every wait stays near the first
+		# delay. Had it doubled, the fifth would be at least 16s even with jitter.
+		with self.fake.cond:
+			connections = list(self.fake.connections)
+			closed = list(self.fake.closed)
+		for attempt in range(min(len(closed), len(connections) - 1)):
+			gap = connections[attempt + 1] - closed[attempt]
+			self.assertLessEqual(gap, 2 * 2 + BLOCKED, 'backoff grew after connection %d' % (attempt + 1))
+
+		# Once the collector behaves again, a single connection carries on
+		self.fake.set_behaviour('normal')
+		self.wait_for(lambda f: len(f.closed) < len(f.connections), 10, 'did not reconnect')
+		settled = time.time()
+		self.wait_for_flushes(8, since=settled)
+		with self.fake.cond:
+			self.assertEqual(len(self.fake.closed) + 1, len(self.fake.connections))
+
+
+class StalledCollector(TelegrafTest):
+	SENDQ = 8192
+	SPOOL = 16384
+
+	def test_sendq_is_bounded(self):
+		# A small receive window keeps the kernel from hiding the backlog from the ircd
+		self.start(FakeTelegraf(rcvbuf=4096), sendq=self.SENDQ, spoolsize=self.SPOOL, toptalkers=32)
+		client = self.client()
+		self.chatter(client)
+		self.wait_for_flushes(4)
+
+		stalled = time.time()
+		self.fake.stall()
+		for _ in range(15):
+			self.assertLess(client.ping(), BLOCKED, 'ircd blocked on a stalled collector')
+			time.sleep(1)
+
+		backlog = self.fake.kernel_backlog(1)
+		status = client.telegraf('status')
+		dropped = [int(n) for s in status for n in re.findall(r'^Lines dropped: (\d+)', s)]
+		spooled = [int(n) for s in status for n in re.findall(r'^Bytes spooled: (\d+)', s)]
+		self.assertTrue(dropped and dropped[0] > 0, 'nothing dropped while stalled: %r' % status)
+		self.assertLessEqual(spooled[0] if spooled else 0, self.SPOOL)
+
+		resumed = time.time()
+		self.fake.resume()
+		self.wait_for_flushes(8, timeout=30, since=resumed)
+		time.sleep(2)
+
+		# Whatever was collected during the stall and only arrived after it was held in the kernel
+		# buffers, the sendq or the spool
+		with self.fake.cond:
+			held = sum(l.size for l in self.fake.lines if l.received >= resumed and stalled <= l.time < resumed)
+			connections = len(self.fake.connections)
+		self.assertLessEqual(held, backlog + self.SENDQ + self.SPOOL)
+		self.assertEqual(connections, 1, 'a stalled collector should not cost the connection')
+		latest = max(self.fake.measurement('ircd'), key=lambda l: l.timestamp)
+		self.assertGreater(latest.fields['metrics_dropped'], 0)
+
+	def test_slow_reader(self):
+		self.start(FakeTelegraf(behaviour='slow', rate=2048), sendq=self.SENDQ, toptalkers=32)
+		client = self.client()
+		self.chatter(client)
+
+		start = time.time()
+		while time.time() < start + 10:
+			self.assertLess(client.ping(), BLOCKED, 'ircd blocked on a slow collector')
+			time.sleep(1)
+
+		with self.fake.cond:
+			self.assertEqual(len(self.fake.connections), 1)
+		flushes = sorted(self.fake.measurement('ircd'), key=lambda l: l.timestamp)
+		# How many flushes get through depends on how fast the machine fills the socket, only that
+		# some do
+		self.assertGreaterEqual(len(flushes), 2, 'slow collector starved')
+		counts = [l.fields['metrics_dropped'] for l in flushes]
+		self.assertEqual(counts, sorted(counts), 'dropped line count went backwards')
+
+
+class Datagrams(TelegrafTest):
+	MTU = 512
+
+	def test_packing(self):
+		self.start(FakeTelegraf('udp'), mtu=self.MTU, toptalkers=32)
+		self.chatter(self.client())
+		self.wait_for_flushes(8)
+		with self.fake.cond:
+			datagrams = list(self.fake.datagrams)
+		for received, size, lines in datagrams:
+			# A line too long for a datagram on its own still goes out alone
+			self.assertTrue(size <= self.MTU or lines == 1, 'datagram of %d bytes with %d lines' % (size, lines))
+		self.assertTrue(any(lines > 1 for received, size, lines in datagrams), 'lines were not packed')
+
+	def test_refused(self):
+		self.start(FakeTelegraf('udp', behaviour='refuse'))
+		self.client(oper=False).ping()
+		time.sleep(2)
+		# Sends fail with connection refused while nothing listens, then pick up again
+		listening = time.time()
+		self.fake.listen()
+		self.wait_for_flushes(2, timeout=20, since=listening)
+
+
+if __name__ == '__main__':
+	if not shutil.which(INSPIRCD):
+		sys.exit('Set INSPIRCD to an inspircd 2.0 binary with m_telegraf.so installed')
+	unittest.main()